@@ -0,0 +1,265 @@
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "control.h"
+#include "utils.h"
+#include "log.h"
+
+namespace control
+{
+    constexpr size_t MAX_REQUEST_SIZE = 4096;
+    constexpr auto CLIENT_TIMEOUT = chrono::seconds{10};
+
+    static void throw_errno(std::string_view what)
+    {
+        throw std::runtime_error(std::string{what} + " : " + std::strerror(errno));
+    }
+
+    static sockaddr_un to_address(const std::string &path)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+            throw std::runtime_error("Control socket path is too long : " + path);
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+    // Closes the connection whatever way a coroutine ends
+    struct closing
+    {
+        ~closing() { close(fd); }
+        int fd;
+    };
+
+    // Shuts the connection down when the client takes too long, which
+    // wakes up the coroutine waiting for it
+    struct deadline
+    {
+        deadline(Reactor &reactor, int fd) : reactor(reactor)
+        {
+            timer = reactor.add_timeout(
+                "Control client",
+                [this, fd]()
+                {
+                    expired = true;
+                    shutdown(fd, SHUT_RDWR);
+                });
+            reactor.set_timeout(timer, CLIENT_TIMEOUT);
+        }
+        deadline(const deadline &) = delete;
+        ~deadline() { reactor.remove(timer); }
+
+        Reactor &reactor;
+        int timer;
+        bool expired{false};
+    };
+
+    Server::Server(Reactor &reactor, std::string path) : reactor_(reactor), path_(std::move(path))
+    {
+        // Held as long as the daemon runs, the kernel releases it however
+        // the daemon stops
+        auto lock_path = path_ + ".lock";
+        lock_fd_ = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lock_fd_ < 0)
+            throw_errno("open " + lock_path);
+        if (flock(lock_fd_, LOCK_EX | LOCK_NB) < 0)
+        {
+            auto error = errno;
+            close(lock_fd_);
+            if (error == EWOULDBLOCK)
+                throw std::runtime_error("Another daemon is listening on " + path_);
+            errno = error;
+            throw_errno("flock " + lock_path);
+        }
+
+        // A socket left by a daemon which did not stop cleanly can be
+        // replaced, anything else at path is not ours
+        struct stat status;
+        if (lstat(path_.c_str(), &status) == 0)
+        {
+            if (!S_ISSOCK(status.st_mode))
+            {
+                close(lock_fd_);
+                throw std::runtime_error(path_ + " exists and is not a socket");
+            }
+            unlink(path_.c_str());
+        }
+
+        auto address = to_address(path_);
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd_ < 0 ||
+            bind(fd_, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) < 0 ||
+            listen(fd_, 16) < 0)
+        {
+            auto error = errno;
+            if (fd_ >= 0)
+                close(fd_);
+            close(lock_fd_);
+            errno = error;
+            throw_errno("bind " + path_);
+        }
+        reactor_.add_fd("Control", fd_, [this]()
+                        { accept_clients(); });
+    }
+
+    Server::~Server()
+    {
+        reactor_.remove(fd_);
+        close(fd_);
+        unlink(path_.c_str());
+        close(lock_fd_);
+    }
+
+    void Server::add_command(std::string name, command c)
+    {
+        commands_[std::move(name)] = std::move(c);
+    }
+
+    void Server::accept_clients()
+    {
+        while (true)
+        {
+            int client = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    throw_errno("accept " + path_);
+                return;
+            }
+            spawn("Control client", serve(client));
+        }
+    }
+
+    task<void> Server::serve(int fd)
+    {
+        closing connection{fd};
+        deadline timeout{reactor_, fd};
+
+        std::string request;
+        while (request.find('\n') == request.npos)
+        {
+            co_await reactor_.readable(fd);
+            if (timeout.expired)
+                throw std::runtime_error("Client timed out on " + path_);
+            char buffer[512];
+            auto length = read(fd, buffer, sizeof(buffer));
+            if (length == 0)
+                break;
+            if (length < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                    continue;
+                throw_errno("read " + path_);
+            }
+            request.append(buffer, length);
+            if (request.size() > MAX_REQUEST_SIZE)
+                throw std::runtime_error("Request too long on " + path_);
+        }
+        request.resize(std::min(request.find('\n'), request.size()));
+
+        auto response = answer(request);
+        std::string_view pending{response};
+        while (!pending.empty())
+        {
+            auto length = send(fd, pending.data(), pending.size(), MSG_NOSIGNAL);
+            if (length < 0)
+            {
+                if (errno != EAGAIN && errno != EINTR)
+                    throw_errno("write " + path_);
+                co_await reactor_.writable(fd);
+                if (timeout.expired)
+                    throw std::runtime_error("Client timed out on " + path_);
+                continue;
+            }
+            pending.remove_prefix(length);
+        }
+    }
+
+    std::string Server::answer(std::string_view request) const
+    {
+        std::vector<std::string_view> args;
+        for (auto word : split(request, ' '))
+            if (!word.empty())
+                args.push_back(word);
+        // An empty request only checks that the daemon is there
+        if (args.empty())
+            return "OK\n";
+
+        auto found = commands_.find(args.front());
+        if (found == commands_.end())
+            return "ERROR Unknown request " + std::string{args.front()} + "\n";
+        args.erase(args.begin());
+        try
+        {
+            return "OK\n" + found->second(args);
+        }
+        catch (std::exception &e)
+        {
+            return "ERROR " + std::string{e.what()} + "\n";
+        }
+    }
+
+    std::optional<std::string> ask(const std::string &path, std::string_view request)
+    {
+        auto address = to_address(path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            throw_errno("socket " + path);
+        closing connection{fd};
+        if (connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) < 0)
+        {
+            if (errno == ENOENT || errno == ECONNREFUSED)
+                return std::nullopt;
+            throw_errno("connect " + path);
+        }
+        // A daemon stuck on something else must not hang its clients
+        timeval timeout{.tv_sec = CLIENT_TIMEOUT.count(), .tv_usec = 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string line{request};
+        line += '\n';
+        std::string_view pending{line};
+        while (!pending.empty())
+        {
+            auto length = send(fd, pending.data(), pending.size(), MSG_NOSIGNAL);
+            if (length < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw_errno("write " + path);
+            }
+            pending.remove_prefix(length);
+        }
+
+        std::string response;
+        char buffer[4096];
+        while (true)
+        {
+            auto length = read(fd, buffer, sizeof(buffer));
+            if (length == 0)
+                break;
+            if (length < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw_errno("read " + path);
+            }
+            response.append(buffer, length);
+        }
+
+        auto [status, text] = split2(response, '\n');
+        if (status == "OK")
+            return std::string{text};
+        if (status.starts_with("ERROR "))
+            throw std::runtime_error(std::string{status.substr(6)});
+        throw std::runtime_error("Unexpected answer on " + path + " : " + std::string{status});
+    }
+}
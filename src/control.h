@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <map>
+#include <optional>
+#include <vector>
+#include "reactor.h"
+#include "task.h"
+
+// Requests to the running daemon over a Unix socket. A request is one line,
+// a command name and its arguments separated by spaces. The answer starts
+// with "OK" or "ERROR <reason>" on its own line, the text of the answer
+// follows until the connection is closed.
+namespace control
+{
+    class Server
+    {
+    public:
+        // Returns the text of the answer, an exception is sent as ERROR
+        using command = std::function<std::string(const std::vector<std::string_view> &args)>;
+
+        // Throws if another process already serves path, it holds an
+        // flock on path.lock
+        Server(Reactor &reactor, std::string path);
+        Server(const Server &) = delete;
+        ~Server();
+
+        void add_command(std::string name, command c);
+
+    protected:
+        void accept_clients();
+        task<void> serve(int fd);
+        std::string answer(std::string_view request) const;
+
+        Reactor &reactor_;
+        std::string path_;
+        int fd_{-1};
+        int lock_fd_{-1};
+        std::map<std::string, command, std::less<>> commands_;
+    };
+
+    // The text of the answer, nothing if no daemon listens on path.
+    // Throws the reason of an ERROR.
+    std::optional<std::string> ask(const std::string &path, std::string_view request);
+}
@@ -1,91 +1,434 @@
 #include "db.h"
+#include "schema.h"
 #include "utils.h"
+#include "log.h"
 #include <string>
-#include <set>
-
-#define SELECT_FROM_EVENT                                    \
-    "SELECT events.START, \n"                                \
-    "       events.END, \n"                                  \
-    "       relays.FULLNAME, \n"                             \
-    "       events.ENTETE, \n"                               \
-    "       relays.CHANNEL,\n"                               \
-    "       relays.STATE,\n"                                 \
-    "       ? >= events.START - relays.INERTIA \n"           \
-    "       AND ? <= events.END as is_current, \n"           \
-    "       events.ID, \n"                                   \
-    "       events.START - relays.INERTIA AS heat_start, \n" \
-    "       CASE WHEN relays.STOP_DURING_MASS \n"            \
-    "               AND events.ENTETE LIKE '%messe%' \n"     \
-    "            THEN events.START \n"                       \
-    "            ELSE events.END \n"                         \
-    "            END \n"                                     \
-    "            AS heat_end \n"                             \
-    "FROM events \n"
-
-#define SELECT_FROM_EVENTS_JOIN_RELAYS \
-    SELECT_FROM_EVENT                  \
-    "JOIN relays \n"                   \
-    "ON events.SALLE LIKE relays.PATTERN_MATCHING \n"
+#include <map>
+#include <filesystem>
+#include <unordered_set>
+#include <utility>
+
+// Heat windows are computed once per event and relay, in event_relay,
+// when events or relays are written
+#define SELECT_FROM_EVENTS_JOIN_RELAYS                        \
+    "SELECT events.START, \n"                                 \
+    "       events.END, \n"                                   \
+    "       relays.FULLNAME, \n"                              \
+    "       events.ENTETE, \n"                                \
+    "       relays.CHANNEL,\n"                                \
+    "       relays.STATE,\n"                                  \
+    "       ? >= event_relay.HEAT_START \n"                   \
+    "       AND ? <= events.END as is_current, \n"            \
+    "       events.ID, \n"                                    \
+    "       event_relay.HEAT_START AS heat_start, \n"         \
+    "       event_relay.HEAT_END AS heat_end \n"              \
+    "FROM events \n"                                          \
+    "JOIN event_relay ON event_relay.EVENT_ID = events.ID \n" \
+    "JOIN relays ON relays.ID = event_relay.RELAY_ID \n"
 
 using namespace std::chrono_literals;
 
-Database::Database(std::string_view path) : sql_(path)
+constexpr auto BUSY_TIMEOUT = 5s;
+
+Database::Database(std::string_view path) : Database(path, Options{})
+{
+}
+
+Database::Database(std::string_view path, const Options &options)
+    : path_(path),
+      archive_dir_(options.archive_dir),
+      archive_months_(options.archive_months),
+      in_memory_(options.in_memory),
+      reader_pool_size_(in_memory_ ? 0 : options.reader_pool_size),
+      profiler_(std::make_shared<SQLite::Profiler>()),
+      sql_(in_memory_ ? ":memory:" : path,
+           {.wal = !in_memory_, .busy_timeout = BUSY_TIMEOUT, .profiler = profiler_})
+{
+    if (in_memory_)
+    {
+        SQLite disk{path_, {.busy_timeout = BUSY_TIMEOUT}};
+        SQLite::backup(disk, sql_);
+        INFO << "Loaded " << path_ << " in memory" << std::endl;
+    }
+    sql_.exec_wo_return("PRAGMA temp_store=MEMORY");
+    schema::migrate(sql_);
+    sql_.set_update_hook(
+        [this](int, std::string_view database, std::string_view table, int64_t rowid)
+        {
+            if (database == "main" && table == "events")
+            {
+                std::lock_guard lock{index_mutex_};
+                written_events_.insert(rowid);
+            }
+        });
+    if (options.write_behind && !in_memory_)
+        relay_state_writer_ = std::make_unique<RelayStateWriter>(
+            path_,
+            SQLite::Options{.busy_timeout = BUSY_TIMEOUT, .profiler = profiler_});
+}
+
+Database::~Database()
+{
+    if (!in_memory_)
+        return;
+    try
+    {
+        snapshot();
+    }
+    catch (std::exception &e)
+    {
+        ERROR << "Impossible to save " << path_ << " : " << e.what() << std::endl;
+    }
+}
+
+void Database::snapshot() const
+{
+    if (!in_memory_)
+        return;
+    SQLite disk{path_, {.wal = true, .busy_timeout = BUSY_TIMEOUT}};
+    SQLite::backup(sql_, disk);
+    DEBUG << "Saved database to " << path_ << std::endl;
+}
+
+Database::Reader::Reader(const Database &db, std::unique_ptr<SQLite> connection)
+    : db_(db), connection_(std::move(connection))
+{
+}
+
+Database::Reader::~Reader()
+{
+    if (!connection_)
+        return;
+    std::lock_guard lock{db_.readers_mutex_};
+    if (db_.readers_.size() < db_.reader_pool_size_)
+        db_.readers_.emplace_back(std::move(connection_));
+}
+
+const SQLite &Database::Reader::operator*() const
+{
+    return connection_ ? *connection_ : db_.sql_;
+}
+
+Database::Reader Database::reader() const
+{
+    if (reader_pool_size_ == 0)
+        return Reader{*this, nullptr};
+    {
+        std::lock_guard lock{readers_mutex_};
+        if (!readers_.empty())
+        {
+            auto connection = std::move(readers_.back());
+            readers_.pop_back();
+            return Reader{*this, std::move(connection)};
+        }
+    }
+    return Reader{*this,
+                  std::make_unique<SQLite>(
+                      path_,
+                      SQLite::Options{.read_only = true,
+                                      .busy_timeout = BUSY_TIMEOUT,
+                                      .profiler = profiler_})};
+}
+
+SQLite::Profiler::Report Database::sql_profile() const
+{
+    return profiler_->report();
+}
+
+void Database::reset_sql_profile()
+{
+    profiler_->reset();
+}
+
+template <>
+struct SQLite::RowDecoder<Database::event>
+{
+    static constexpr int columns = 10;
+    static Database::event decode(const SQLite::Row &row)
+    {
+        Database::event retval;
+        retval.start = row.get<timepoint>(0);
+        retval.end = row.get<timepoint>(1);
+        retval.room = row.get<std::string>(2);
+        retval.description = row.get<std::string>(3);
+        retval.channel = row.get<std::string>(4);
+        retval.state = row.get<bool>(5);
+        retval.is_current = row.get<bool>(6);
+        retval.id = row.get<int64_t>(7);
+        retval.heat_start = row.get<timepoint>(8);
+        retval.heat_end = row.get<timepoint>(9);
+        return retval;
+    }
+};
+
+template <>
+struct SQLite::RowDecoder<EventIndex::relay>
+{
+    static constexpr int columns = 4;
+    static EventIndex::relay decode(const SQLite::Row &row)
+    {
+        return {.id = row.get<int64_t>(0),
+                .channel = row.get<std::string>(1),
+                .fullname = row.get<std::string>(2),
+                .state = row.get<bool>(3)};
+    }
+};
+
+template <>
+struct SQLite::RowDecoder<EventIndex::entry>
 {
+    static constexpr int columns = 7;
+    static EventIndex::entry decode(const SQLite::Row &row)
+    {
+        return {.event_id = row.get<int64_t>(0),
+                .relay_id = row.get<int64_t>(1),
+                .heat_start = row.get<timepoint>(2),
+                .heat_end = row.get<timepoint>(3),
+                .start = row.get<timepoint>(4),
+                .end = row.get<timepoint>(5),
+                .description = row.get<std::string>(6)};
+    }
+};
+
+static Database::event to_event(const EventIndex::relay &r,
+                                const EventIndex::entry &e,
+                                timepoint now)
+{
+    return {.id = e.event_id,
+            .heat_start = e.heat_start,
+            .heat_end = e.heat_end,
+            .start = e.start,
+            .end = e.end,
+            .room = r.fullname,
+            .channel = r.channel,
+            .description = e.description,
+            .state = r.state,
+            .is_current = e.heat_start <= now && now <= e.end};
 }
 
-static Database::event create_event(const SQLite::SqlRow &row)
+template <typename T>
+static std::vector<T> collect(SQLite::Rows<T> &&rows)
+{
+    std::vector<T> retval;
+    for (auto &&e : rows)
+        retval.emplace_back(std::move(e));
+    return retval;
+}
+
+constexpr auto FETCH_EARLIEST_IN_FUTURE_SQL =
+    SELECT_FROM_EVENTS_JOIN_RELAYS
+    "JOIN (\n"
+    "     SELECT MIN(e.START) as start,\n"
+    "            er.RELAY_ID as relay_id \n"
+    "     FROM events e \n"
+    "     JOIN event_relay er \n"
+    "     ON er.EVENT_ID = e.ID \n"
+    "     WHERE e.START > ? \n"
+    "     GROUP BY er.RELAY_ID \n"
+    "     ) s \n"
+    "ON s.relay_id = relays.ID AND s.start = events.START";
+
+constexpr auto FETCH_ALL_TO_COME_SQL =
+    SELECT_FROM_EVENTS_JOIN_RELAYS
+    "WHERE ? <= events.END \n"
+    "ORDER BY events.START \n"
+    "LIMIT 10 ";
+
+// Events are paged, with all their relays, so that (START, ID) is enough
+// to resume. Those without relay are skipped for a page never to be empty
+// before the end. The single lower bound on START lets each page start
+// its index range where the previous one stopped.
+constexpr auto FETCH_BETWEEN_PAGE_SQL =
+    SELECT_FROM_EVENTS_JOIN_RELAYS
+    "WHERE events.ID IN ( \n"
+    "    SELECT e.ID FROM events e \n"
+    "    WHERE e.START >= MAX(?, ?) AND e.START <= ? \n"
+    "    AND (e.START, e.ID) > (?, ?) \n"
+    "    AND EXISTS (SELECT 1 FROM event_relay er WHERE er.EVENT_ID = e.ID) \n"
+    "    ORDER BY e.START, e.ID \n"
+    "    LIMIT ?) \n"
+    "ORDER BY events.START, events.ID, relays.ID";
+
+// The room is SALLE, events without relay are kept
+constexpr auto SEARCH_EVENTS_SQL =
+    "SELECT events.START, \n"
+    "       events.END, \n"
+    "       events.SALLE, \n"
+    "       events.ENTETE, \n"
+    "       COALESCE(relays.CHANNEL, ''), \n"
+    "       COALESCE(relays.STATE, 0), \n"
+    "       COALESCE(? >= event_relay.HEAT_START AND ? <= events.END, 0), \n"
+    "       events.ID, \n"
+    "       COALESCE(event_relay.HEAT_START, events.START), \n"
+    "       COALESCE(event_relay.HEAT_END, events.END) \n"
+    "FROM events_fts \n"
+    "JOIN events ON events.ID = events_fts.rowid \n"
+    "LEFT JOIN event_relay ON event_relay.EVENT_ID = events.ID \n"
+    "LEFT JOIN relays ON relays.ID = event_relay.RELAY_ID \n"
+    "WHERE events_fts MATCH ? \n"
+    "ORDER BY events.START, events.ID, relays.ID";
+
+constexpr auto LOAD_RELAYS_SQL =
+    "SELECT ID, CHANNEL, FULLNAME, STATE FROM relays";
+
+#define SELECT_HEAT_WINDOWS                                    \
+    "SELECT event_relay.EVENT_ID, \n"                          \
+    "       event_relay.RELAY_ID, \n"                          \
+    "       event_relay.HEAT_START, \n"                        \
+    "       event_relay.HEAT_END, \n"                          \
+    "       events.START, \n"                                  \
+    "       events.END, \n"                                    \
+    "       events.ENTETE \n"                                  \
+    "FROM event_relay \n"                                      \
+    "JOIN events ON events.ID = event_relay.EVENT_ID \n"
+
+constexpr auto LOAD_HEAT_WINDOWS_SQL = SELECT_HEAT_WINDOWS;
+
+constexpr auto LOAD_EVENT_HEAT_WINDOWS_SQL =
+    SELECT_HEAT_WINDOWS
+    "WHERE event_relay.EVENT_ID = ?";
+
+bool Database::check_query_plans() const
 {
-    if (row.size() != 10)
-        throw std::runtime_error{"impossible to create event from sql row"};
-    Database::event retval;
-    retval.start = from_timestamp(row[0]);
-    retval.end = from_timestamp(row[1]);
-    retval.room = row[2];
-    retval.description = row[3];
-    retval.channel = row[4];
-    retval.state = std::stoi(row[5]);
-    retval.is_current = std::stoi(row[6]);
-    retval.id = std::stoi(row[7]);
-    retval.heat_start = from_timestamp(row[8]);
-    retval.heat_end = from_timestamp(row[9]);
+    constexpr std::pair<std::string_view, std::string_view> hot_queries[] = {
+        {"fetch_earliest_in_future", FETCH_EARLIEST_IN_FUTURE_SQL},
+        {"fetch_all_to_come", FETCH_ALL_TO_COME_SQL},
+        {"fetch_between_page", FETCH_BETWEEN_PAGE_SQL},
+    };
+
+    bool retval = true;
+    auto sql = reader();
+    for (const auto &[name, req] : hot_queries)
+    {
+        for (const auto &detail : sql->explain(req))
+        {
+            DEBUG << name << " : " << detail << std::endl;
+            bool full_scan = detail.starts_with("SCAN ") &&
+                             detail.find(" USING ") == detail.npos;
+            bool on_events = detail.starts_with("SCAN events") ||
+                             detail.starts_with("SCAN e ") ||
+                             detail == "SCAN e";
+            if (full_scan && on_events)
+            {
+                WARNING << name << " does a full scan of events : " << detail << std::endl;
+                retval = false;
+            }
+        }
+    }
     return retval;
 }
+
 Database::events Database::fetch_earliest_in_future() const
 {
     auto now = get_time_now();
-    Database::events retval;
-    for (const auto &row : sql_.exec(
-             SELECT_FROM_EVENT
-             "JOIN (\n"
-             "     SELECT MIN(e.start) as start,\n"
-             "            relays.PATTERN_MATCHING as pattern \n"
-             "     FROM events e \n"
-             "     JOIN relays \n"
-             "     ON e.SALLE LIKE relays.PATTERN_MATCHING \n"
-             "     WHERE e.start > ? \n"
-             "     GROUP BY pattern \n"
-             "     ) s \n"
-             "ON events.SALLE LIKE s.pattern AND s.start = events.START \n"
-             "JOIN relays \n"
-             "ON relays.PATTERN_MATCHING = s.pattern",
-             {now, now, now}))
+    return collect(reader()->query<event>(
+        FETCH_EARLIEST_IN_FUTURE_SQL,
+        now, now, now));
+}
+
+std::unique_lock<std::mutex> Database::lock_index() const
+{
+    std::unique_lock lock{index_mutex_};
+    // Inside a transaction the index keeps showing the last commit, as
+    // the readers do
+    if (sql_.in_transaction())
+        return lock;
+    auto data_version = sql_.query<int64_t>("PRAGMA data_version").first().value_or(0);
+    if (!index_stale_ && data_version != index_data_version_ &&
+        written_events_.empty() && schedule_changes() == index_schedule_changes_)
     {
-        retval.emplace_back(create_event(row));
+        // Only relay states were written, by the relay state writer most
+        // of the time
+        load_relay_states();
+        index_data_version_ = data_version;
+        return lock;
     }
-    return retval;
+    if (index_stale_ || data_version != index_data_version_)
+    {
+        index_schedule_changes_ = schedule_changes();
+        load_index();
+        index_stale_ = false;
+        index_data_version_ = data_version;
+    }
+    else if (!written_events_.empty())
+    {
+        index_schedule_changes_ = schedule_changes();
+        apply_written_events();
+    }
+    return lock;
+}
+
+int64_t Database::schedule_changes() const
+{
+    return sql_.query<int64_t>("SELECT COUNT FROM schedule_changes").first().value_or(0);
+}
+
+void Database::load_relay_states() const
+{
+    for (const auto &relay : sql_.query<EventIndex::relay>(LOAD_RELAYS_SQL))
+        index_.set_state(relay.channel, relay.state);
+}
+
+void Database::load_index() const
+{
+    auto before = index_.channel_fingerprints();
+    index_.clear();
+    written_events_.clear();
+    auto sql = reader();
+    for (auto relay : sql->query<EventIndex::relay>(LOAD_RELAYS_SQL))
+        index_.add_relay(std::move(relay));
+    index_.insert(collect(sql->query<EventIndex::entry>(LOAD_HEAT_WINDOWS_SQL)));
+    DEBUG << "Loaded " << index_.size() << " heat windows in memory" << std::endl;
+
+    auto after = index_.channel_fingerprints();
+    for (const auto &[channel, fingerprint] : after)
+        if (auto it = before.find(channel); it == before.end() || it->second != fingerprint)
+            changed_channels_.insert(channel);
+    for (const auto &[channel, fingerprint] : before)
+        if (!after.contains(channel))
+            changed_channels_.insert(channel);
+}
+
+void Database::apply_written_events() const
+{
+    if (written_events_.empty())
+        return;
+    if (written_events_.size() > index_.size() / 4)
+    {
+        load_index();
+        return;
+    }
+
+    // Ids of rolled back writes are reloaded as well, they are then
+    // unchanged
+    auto channels = index_.channels_of(written_events_);
+    index_.erase(written_events_);
+    std::vector<EventIndex::entry> entries;
+    for (auto id : written_events_)
+        for (auto e : sql_.query<EventIndex::entry>(LOAD_EVENT_HEAT_WINDOWS_SQL, id))
+            entries.emplace_back(std::move(e));
+    index_.insert(std::move(entries));
+    channels.merge(index_.channels_of(written_events_));
+    changed_channels_.merge(channels);
+    written_events_.clear();
+}
+
+std::set<std::string> Database::take_changed_channels()
+{
+    auto lock = lock_index();
+    return std::exchange(changed_channels_, {});
 }
 
 Database::events Database::fetch_current() const
 {
     auto now = get_time_now();
     Database::events retval;
-    for (const auto &row : sql_.exec(
-             SELECT_FROM_EVENTS_JOIN_RELAYS
-             "WHERE is_current ",
-             {now, now}))
-    {
-        retval.emplace_back(create_event(row));
-    }
+    auto lock = lock_index();
+    index_.visit_current(now,
+                         [&](const auto &r, const auto &e)
+                         {
+                             retval.emplace_back(to_event(r, e, now));
+                         });
     return retval;
 }
 
@@ -93,31 +436,28 @@ Database::events Database::fetch_currently_heating() const
 {
     auto now = get_time_now();
     Database::events retval;
-    for (const auto &row : sql_.exec(
-             SELECT_FROM_EVENTS_JOIN_RELAYS
-             "WHERE ? >= heat_start \n"
-             "AND ? <= heat_end ",
-             {now, now, now, now}))
-    {
-        retval.emplace_back(create_event(row));
-    }
+    auto lock = lock_index();
+    index_.visit_heating(now,
+                         [&](const auto &r, const auto &e)
+                         {
+                             retval.emplace_back(to_event(r, e, now));
+                         });
     return retval;
 }
 
+std::map<std::string, timepoint> Database::fetch_next_transitions() const
+{
+    auto now = get_time_now();
+    auto lock = lock_index();
+    return index_.next_boundaries(now);
+}
+
 Database::events Database::fetch_all_to_come() const
 {
     auto now = get_time_now();
-    Database::events retval;
-    for (const auto &row : sql_.exec(
-             SELECT_FROM_EVENTS_JOIN_RELAYS
-             "WHERE ? <= events.END \n"
-             "ORDER BY events.START \n"
-             "LIMIT 10 ",
-             {now, now, now}))
-    {
-        retval.emplace_back(create_event(row));
-    }
-    return retval;
+    return collect(reader()->query<event>(
+        FETCH_ALL_TO_COME_SQL,
+        now, now, now));
 }
 
 Database::events Database::fetch_between(
@@ -131,126 +471,483 @@ Database::events Database::fetch_between(int64_t before, int64_t after) const
 {
     auto now = get_time_now();
     Database::events retval;
-    for (const auto &row : sql_.exec(
-             SELECT_FROM_EVENTS_JOIN_RELAYS
-             "WHERE ? <= events.START \n"
-             "AND events.START <= ?",
-             {now, now, before, after}))
+    auto lock = lock_index();
+    index_.visit_between(from_timestamp(before),
+                         from_timestamp(after),
+                         [&](const auto &r, const auto &e)
+                         {
+                             retval.emplace_back(to_event(r, e, now));
+                         });
+    return retval;
+}
+
+void Database::fetch_between(int64_t before,
+                             int64_t after,
+                             const event_visitor &visitor) const
+{
+    constexpr auto archived_sql =
+        "SELECT START, END, FULLNAME, ENTETE, CHANNEL, 0, 0, \n"
+        "       EVENT_ID, HEAT_START, HEAT_END \n"
+        "FROM events \n"
+        "WHERE START >= ? AND START <= ? AND RELAY_ID <> 0 \n"
+        "ORDER BY START, EVENT_ID, RELAY_ID";
+    // Partitions hold the events starting in their month
+    constexpr auto months_sql =
+        "SELECT strftime('%Y-%m', ?, 'unixepoch'), strftime('%Y-%m', ?, 'unixepoch')";
+    auto [first_month, last_month] =
+        reader()->query<std::tuple<std::string, std::string>>(months_sql, before, after).first().value();
+    auto partitions = archive_partitions();
+    for (auto it = partitions.lower_bound(first_month);
+         it != partitions.end() && it->first <= last_month;
+         ++it)
     {
-        retval.emplace_back(create_event(row));
+        SQLite archive{it->second, {.read_only = true, .busy_timeout = BUSY_TIMEOUT}};
+        for (const auto &e : archive.query<event>(archived_sql, before, after))
+            visitor(e);
     }
+
+    page_key from;
+    for (auto page = fetch_between_page(before, after, from);
+         !page.empty();
+         page = fetch_between_page(before, after, from))
+        for (const auto &e : page)
+            visitor(e);
+}
+
+Database::events Database::fetch_between_page(int64_t before,
+                                              int64_t after,
+                                              page_key &from,
+                                              size_t page_size) const
+{
+    auto now = get_time_now();
+    auto retval = collect(reader()->query<event>(
+        FETCH_BETWEEN_PAGE_SQL,
+        now, now,
+        before, from.start, after, from.start, from.id, static_cast<int64_t>(page_size)));
+    if (!retval.empty())
+        from = {retval.back().start, retval.back().id};
     return retval;
 }
 
 size_t Database::current_and_future_events_count() const
 {
-    auto test_sql = "SELECT NULL FROM events WHERE \n"
-                    " END>=?";
-    return sql_.exec(
-                   test_sql,
-                   {get_time_now()})
-        .size();
+    constexpr auto test_sql = "SELECT COUNT(*) FROM events WHERE \n"
+                              " END>=?";
+    return reader()->query<int64_t>(test_sql, get_time_now()).first().value_or(0);
 }
 
-void Database::add_event(const event &e)
+SQLite::Transaction Database::transaction()
 {
-    auto insert_sql =
-        "INSERT INTO events (SALLE, START, END, ENTETE) \n"
-        "            VALUES (?,?,?,?)";
+    return sql_.transaction();
+}
+
+bool Database::add_event(const event &e)
+{
+    constexpr auto insert_sql =
+        "INSERT INTO events (SALLE, START, END, ENTETE, HASH) \n"
+        "            VALUES (?,?,?,?,?) \n"
+        "ON CONFLICT (HASH) WHERE UID IS NULL DO NOTHING";
 
-    sql_.exec(insert_sql,
-              {e.room,
-               e.start,
-               e.end,
-               e.description});
+    return sql_.exec(insert_sql,
+                     e.room,
+                     e.start,
+                     e.end,
+                     e.description,
+                     schema::content_hash(e.room,
+                                          e.description,
+                                          to_timestamp(e.start),
+                                          to_timestamp(e.end))) > 0;
 }
 
 void Database::update_events(const ics::events &ics_events)
 {
-    auto transaction = sql_.transaction();
+    archive_past_months();
+    sync_events(ics_events);
+}
+
+std::map<std::string, std::string> Database::archive_partitions() const
+{
+    std::map<std::string, std::string> retval;
+    if (archive_dir_.empty() || !std::filesystem::is_directory(archive_dir_))
+        return retval;
+    for (const auto &entry : std::filesystem::directory_iterator{archive_dir_})
+    {
+        auto name = entry.path().filename().string();
+        if (name.size() == std::string_view{"events-YYYY-MM.db"}.size() &&
+            name.starts_with("events-") && name.ends_with(".db"))
+            retval.emplace(name.substr(7, 7), entry.path().string());
+    }
+    return retval;
+}
+
+void Database::archive_past_months()
+{
+    // ATTACH is impossible inside a transaction, left to the next sync
+    if (sql_.in_transaction())
+        return;
+
     auto now = get_time_now();
-    auto drop_old_sql =
-        "DELETE FROM events WHERE events.END < ?";
-    sql_.exec(drop_old_sql, {now - chrono::months{1}});
-
-    events db_events;
-    auto find_id_sql =
-        "SELECT events.ID FROM events \n"
-        " WHERE events.START = ? \n"
-        " AND events.END = ? \n"
-        " AND events.SALLE = ? \n"
-        " AND events.ENTETE = ? ";
-    std::set<int64_t> id_to_keep;
-    events events_to_add;
-    for (const auto &e : ics_events.events)
+    constexpr auto cutoff_sql =
+        "SELECT CAST(strftime('%s', ?, 'unixepoch', 'start of month', '-1 month') AS INTEGER)";
+    auto cutoff = sql_.query<int64_t>(cutoff_sql, now).first().value();
+    constexpr auto oldest_sql =
+        "SELECT START FROM events ORDER BY START LIMIT 1";
+    constexpr auto month_sql =
+        "SELECT strftime('%Y-%m', ?, 'unixepoch'), \n"
+        "       CAST(strftime('%s', ?, 'unixepoch', 'start of month', '+1 month') AS INTEGER)";
+    constexpr auto delete_sql =
+        "DELETE FROM events WHERE START < ?";
+
+    for (auto oldest = sql_.query<int64_t>(oldest_sql).first();
+         oldest && *oldest < cutoff;
+         oldest = sql_.query<int64_t>(oldest_sql).first())
     {
-        auto id_candidates = sql_.exec(find_id_sql, {e.start, e.end, e.location, e.summary});
-        if (!id_candidates.empty())
+        auto [month, month_end] =
+            sql_.query<std::tuple<std::string, int64_t>>(month_sql, *oldest, *oldest).first().value();
+        if (archive_dir_.empty())
+        {
+            sql_.exec(delete_sql, month_end);
+            continue;
+        }
+
+        std::filesystem::create_directories(archive_dir_);
+        auto partition = (std::filesystem::path{archive_dir_} / ("events-" + month + ".db")).string();
+        sql_.exec("ATTACH DATABASE ? AS archive", partition);
+        try
         {
-            auto id = std::stoll(id_candidates[0][0]);
-            id_to_keep.emplace(id);
+            auto transaction = sql_.transaction();
+            sql_.exec_wo_return(
+                "CREATE TABLE IF NOT EXISTS archive.events ( \n"
+                "    EVENT_ID INTEGER NOT NULL, \n"
+                "    RELAY_ID INTEGER NOT NULL, \n"
+                "    CHANNEL TEXT NOT NULL, \n"
+                "    FULLNAME TEXT NOT NULL, \n"
+                "    ENTETE TEXT NOT NULL, \n"
+                "    START INT NOT NULL, \n"
+                "    END INT NOT NULL, \n"
+                "    HEAT_START INT NOT NULL, \n"
+                "    HEAT_END INT NOT NULL, \n"
+                "    UID TEXT, \n"
+                "    PRIMARY KEY (EVENT_ID, RELAY_ID)) WITHOUT ROWID; \n"
+                "CREATE INDEX IF NOT EXISTS archive.events_start \n"
+                "    ON events (START, EVENT_ID, RELAY_ID);");
+            // Events without relay are kept as well, with RELAY_ID 0 and
+            // the room as FULLNAME
+            constexpr auto archive_sql =
+                "INSERT OR REPLACE INTO archive.events \n"
+                "SELECT events.ID, COALESCE(relays.ID, 0), COALESCE(relays.CHANNEL, ''), \n"
+                "       COALESCE(relays.FULLNAME, events.SALLE), \n"
+                "       events.ENTETE, events.START, events.END, \n"
+                "       COALESCE(event_relay.HEAT_START, events.START), \n"
+                "       COALESCE(event_relay.HEAT_END, events.END), events.UID \n"
+                "FROM main.events \n"
+                "LEFT JOIN main.event_relay ON event_relay.EVENT_ID = events.ID \n"
+                "LEFT JOIN main.relays ON relays.ID = event_relay.RELAY_ID \n"
+                "WHERE events.START < ?";
+            sql_.exec(archive_sql, month_end);
+            sql_.exec(delete_sql, month_end);
+            transaction.success();
         }
-        else if (e.start > now)
+        catch (...)
         {
-            events_to_add.emplace_back(event{
-                .start = e.start,
-                .end = e.end,
-                .room = e.location,
-                .description = e.summary,
-            });
+            sql_.exec_wo_return("DETACH DATABASE archive");
+            throw;
         }
+        sql_.exec_wo_return("DETACH DATABASE archive");
+        INFO << "Archived the events of " << month << " in " << partition << std::endl;
     }
-    auto get_ids_sql = "SELECT id FROM events WHERE events.START > ?";
-    auto delete_id_sql = "DELETE FROM events WHERE ID = ?";
-    for (const auto &row : sql_.exec(get_ids_sql, {now}))
+
+    constexpr auto retention_sql =
+        "SELECT strftime('%Y-%m', ?, 'unixepoch', 'start of month', printf('-%d months', ?))";
+    auto keep_from = sql_.query<std::string>(retention_sql, now, archive_months_).first().value();
+    for (const auto &[month, partition] : archive_partitions())
     {
-        auto id = std::stoll(row[0]);
-        if (!id_to_keep.count(id))
-            sql_.exec(delete_id_sql, {id});
+        if (month >= keep_from)
+            break;
+        std::filesystem::remove(partition);
+        INFO << "Dropped archive partition " << partition << std::endl;
     }
+}
+
+void Database::sync_events(const ics::events &ics_events)
+{
+    auto transaction = sql_.transaction();
+    auto now = get_time_now();
 
-    for (const auto &e : events_to_add)
-        add_event(e);
-    // if (!events_to_add.empty())
-    //     throw std::runtime_error{"leaving"};
+    // Only future events follow the calendar, past ones are kept as they
+    // were heated. Events are matched on their UID, or on their content
+    // when the calendar gives none, uses the same for several events or
+    // gives one a past event keeps (the next occurrence of a recurring
+    // event).
+    auto hash = [](const ics::vevent &e)
+    {
+        return schema::content_hash(e.location,
+                                    e.summary,
+                                    to_timestamp(e.start),
+                                    to_timestamp(e.end));
+    };
+    std::unordered_map<std::string_view, const ics::vevent *> by_uid;
+    std::unordered_set<std::string_view> shared_uids;
+    for (const auto &e : ics_events.events)
+        if (e.start > now && !e.uid.empty() && !by_uid.emplace(e.uid, &e).second)
+            shared_uids.insert(e.uid);
+    constexpr auto past_uids_sql =
+        "SELECT UID FROM events WHERE START <= ? AND UID IS NOT NULL";
+    for (const auto &uid : sql_.query<std::string>(past_uids_sql, now))
+        if (auto it = by_uid.find(uid); it != by_uid.end())
+            shared_uids.insert(it->first);
+    for (auto uid : shared_uids)
+        by_uid.erase(uid);
+    auto keyed_on_uid = [&](const ics::vevent &e)
+    {
+        return !e.uid.empty() && !shared_uids.contains(e.uid);
+    };
+
+    std::unordered_set<int64_t> by_hash;
+    std::unordered_map<int64_t, const ics::vevent *> uid_events_by_hash;
+    for (const auto &e : ics_events.events)
+    {
+        if (e.start <= now)
+            continue;
+        if (keyed_on_uid(e))
+            uid_events_by_hash.emplace(hash(e), &e);
+        else
+            by_hash.insert(hash(e));
+    }
+
+    std::vector<int64_t> to_delete;
+    std::vector<std::pair<int64_t, const ics::vevent *>> to_update;
+    std::vector<std::pair<int64_t, const ics::vevent *>> to_adopt;
+    constexpr auto stored_sql =
+        "SELECT ID, UID, SEQUENCE, LAST_MODIFIED, HASH FROM events \n"
+        "WHERE START > ?";
+    for (const auto &[id, uid, sequence, last_modified, stored_hash] :
+         sql_.query<std::tuple<int64_t, std::string, int64_t, timepoint, int64_t>>(stored_sql, now))
+    {
+        if (!uid.empty())
+        {
+            auto it = by_uid.find(uid);
+            if (it == by_uid.end())
+            {
+                to_delete.push_back(id);
+                continue;
+            }
+            const auto &e = *it->second;
+            if (std::tie(e.sequence, e.last_modified) > std::tie(sequence, last_modified))
+                to_update.emplace_back(id, &e);
+            by_uid.erase(it);
+        }
+        else if (by_hash.erase(stored_hash))
+            continue;
+        // Stored before the calendar gave UIDs, or added by hand
+        else if (auto it = uid_events_by_hash.find(stored_hash);
+                 it != uid_events_by_hash.end() && by_uid.erase(it->second->uid))
+            to_adopt.emplace_back(id, it->second);
+        else
+            to_delete.push_back(id);
+    }
+
+    constexpr auto delete_sql =
+        "DELETE FROM events WHERE ID = ?";
+    for (auto id : to_delete)
+        sql_.exec(delete_sql, id);
+
+    constexpr auto update_sql =
+        "UPDATE events \n"
+        "SET SALLE = ?, ENTETE = ?, START = ?, END = ?, HASH = ?, \n"
+        "    SEQUENCE = ?, LAST_MODIFIED = ? \n"
+        "WHERE ID = ?";
+    for (const auto &[id, e] : to_update)
+        sql_.exec(update_sql,
+                  e->location, e->summary, e->start, e->end, hash(*e),
+                  e->sequence, e->last_modified, id);
+
+    constexpr auto adopt_sql =
+        "UPDATE events SET UID = ?, SEQUENCE = ?, LAST_MODIFIED = ? \n"
+        "WHERE ID = ?";
+    for (const auto &[id, e] : to_adopt)
+        sql_.exec(adopt_sql, e->uid, e->sequence, e->last_modified, id);
+
+    // Past events are never rewritten, whatever the calendar says
+    constexpr auto insert_sql =
+        "INSERT INTO events (SALLE, START, END, ENTETE, HASH, \n"
+        "                    UID, SEQUENCE, LAST_MODIFIED) \n"
+        "            VALUES (?,?,?,?,?,NULLIF(?, ''),?,?) \n"
+        "ON CONFLICT (UID) DO UPDATE \n"
+        "SET SALLE = excluded.SALLE, ENTETE = excluded.ENTETE, \n"
+        "    START = excluded.START, END = excluded.END, HASH = excluded.HASH, \n"
+        "    SEQUENCE = excluded.SEQUENCE, LAST_MODIFIED = excluded.LAST_MODIFIED \n"
+        "WHERE events.START > ? \n"
+        "    AND (excluded.SEQUENCE, excluded.LAST_MODIFIED) \n"
+        "        > (events.SEQUENCE, events.LAST_MODIFIED)";
+    size_t added = 0;
+    for (const auto &e : ics_events.events)
+    {
+        if (e.start <= now)
+            continue;
+        auto h = hash(e);
+        bool keyed = keyed_on_uid(e);
+        if (!(keyed ? by_uid.erase(e.uid) : by_hash.erase(h)))
+            continue;
+        if (sql_.exec(insert_sql,
+                      e.location, e.start, e.end, e.summary, h,
+                      keyed ? std::string_view{e.uid} : std::string_view{},
+                      e.sequence, e.last_modified, now) > 0)
+            added++;
+        else
+            WARNING << "Calendar event " << e.uid << " at " << to_timestamp(e.start)
+                    << " is not stored" << std::endl;
+    }
+
+    DEBUG << "Synchronising calendar : " << to_delete.size() << " events removed, "
+          << to_update.size() << " updated, "
+          << added << " added" << std::endl;
     transaction.success();
 }
 
 bool Database::fetch_channel_state(std::string_view channel) const
 {
-    auto sql =
+    constexpr auto sql =
         "SELECT relays.STATE FROM relays \n"
         "WHERE CHANNEL = ?";
-    auto res = sql_.exec(sql, {channel});
-    if (res.empty())
+    auto state = reader()->query<bool>(sql, channel).first();
+    if (!state)
         throw std::runtime_error("Unknown channel " + std::string{channel});
-    return res[0][0] == "1";
+    return *state;
 }
 
 std::vector<std::string> Database::fetch_channel_description(std::string_view channel) const
 {
     std::vector<std::string> retval;
-    auto sql =
+    constexpr auto sql =
         "SELECT relays.FULLNAME FROM relays \n"
         "WHERE CHANNEL = ?";
-    auto res = sql_.exec(sql, {channel});
-    if (res.empty())
+    auto connection = reader();
+    for (auto fullname : connection->query<std::string>(sql, channel))
+        retval.emplace_back(std::move(fullname));
+    if (retval.empty())
         throw std::runtime_error("Unknown channel " + std::string{channel});
-    for (const auto &row : res)
-        retval.emplace_back(row[0]);
     return retval;
 }
 
 void Database::update_channel(std::string_view channel, bool state)
 {
-    auto now = std::to_string(to_timestamp(get_time_now()));
-    auto state_str = std::to_string(state);
-    auto update_sql =
-        "UPDATE relays \n"
-        "SET STATE = ?, LAST_UPDATE = ? \n"
-        "WHERE CHANNEL = ? AND STATE <> ?";
-    sql_.exec(update_sql, {state_str,
-                           now,
-                           channel,
-                           state_str});
+    {
+        std::lock_guard lock{index_mutex_};
+        index_.set_state(channel, state);
+    }
+    auto now = get_time_now();
+    if (relay_state_writer_ && relay_state_writer_->push(channel, state, now))
+        return;
+    RelayStateWriter::write(sql_, channel, state, now);
+}
+
+void Database::flush_channel_states()
+{
+    if (relay_state_writer_)
+        relay_state_writer_->flush();
+}
+
+void Database::add_relay_transition(std::string_view channel, bool state)
+{
+    auto now = get_time_now();
+    if (relay_state_writer_ && relay_state_writer_->push_transition(channel, state, now))
+        return;
+    RelayStateWriter::write_transition(sql_, channel, state, now);
+}
+
+// Local midnight starting the day of a timestamp, as a timestamp
+#define LOCAL_DAY(timestamp) \
+    "CAST(strftime('%s', " timestamp ", 'unixepoch', 'localtime', 'start of day', 'utc') AS INTEGER)"
+
+void Database::rollup_relay_transitions()
+{
+    constexpr int64_t HOUR = 3600;
+    auto now = to_timestamp(get_time_now());
+    auto until = now - now % HOUR;
+
+    auto transaction = sql_.transaction();
+    auto channels = collect(sql_.query<std::string>(
+        "SELECT DISTINCT CHANNEL FROM relay_transitions"));
+    for (const auto &channel : channels)
+    {
+        constexpr auto progress_sql =
+            "SELECT UNTIL, STATE FROM relay_rollup_progress WHERE CHANNEL = ?";
+        constexpr auto first_sql =
+            "SELECT MIN(TIME) FROM relay_transitions WHERE CHANNEL = ?";
+        int64_t from;
+        bool state = false;
+        if (auto progress = sql_.query<std::tuple<int64_t, bool>>(progress_sql, channel).first())
+            std::tie(from, state) = *progress;
+        else
+        {
+            from = sql_.query<int64_t>(first_sql, channel).first().value_or(until);
+            from -= from % HOUR;
+        }
+        if (from >= until)
+            continue;
+
+        std::map<int64_t, int64_t> on_seconds;
+        auto add_on_time = [&](int64_t begin, int64_t end)
+        {
+            for (auto hour = begin - begin % HOUR; hour < end; hour += HOUR)
+                on_seconds[hour] += std::min(end, hour + HOUR) - std::max(begin, hour);
+        };
+        constexpr auto transitions_sql =
+            "SELECT TIME, STATE FROM relay_transitions \n"
+            "WHERE CHANNEL = ? AND TIME >= ? AND TIME < ? \n"
+            "ORDER BY TIME";
+        auto since = from;
+        for (auto [time, new_state] :
+             sql_.query<std::tuple<int64_t, bool>>(transitions_sql, channel, from, until))
+        {
+            if (state)
+                add_on_time(since, time);
+            since = time;
+            state = new_state;
+        }
+        if (state)
+            add_on_time(since, until);
+
+        constexpr auto hourly_sql =
+            "INSERT OR REPLACE INTO relay_hourly_on_time (CHANNEL, HOUR, ON_SECONDS) \n"
+            "                                     VALUES (?,?,?)";
+        for (auto [hour, seconds] : on_seconds)
+            if (seconds > 0)
+                sql_.exec(hourly_sql, channel, hour, seconds);
+
+        constexpr auto daily_sql =
+            "INSERT OR REPLACE INTO relay_daily_on_time (CHANNEL, DAY, ON_SECONDS) \n"
+            "SELECT CHANNEL, " LOCAL_DAY("HOUR") ", SUM(ON_SECONDS) \n"
+            "FROM relay_hourly_on_time \n"
+            "WHERE CHANNEL = ? AND HOUR >= " LOCAL_DAY("?") " \n"
+            "GROUP BY 2";
+        sql_.exec(daily_sql, channel, from);
+
+        constexpr auto save_progress_sql =
+            "INSERT OR REPLACE INTO relay_rollup_progress (CHANNEL, UNTIL, STATE) \n"
+            "                                      VALUES (?,?,?)";
+        sql_.exec(save_progress_sql, channel, until, state);
+    }
+    transaction.success();
+}
+
+std::vector<Database::on_time> Database::fetch_daily_on_time(int64_t before, int64_t after) const
+{
+    constexpr auto sql =
+        "SELECT CHANNEL, DAY, ON_SECONDS FROM relay_daily_on_time \n"
+        "WHERE DAY >= ? AND DAY <= ? \n"
+        "ORDER BY DAY, CHANNEL";
+    std::vector<on_time> retval;
+    auto connection = reader();
+    for (auto [channel, day, seconds] :
+         connection->query<std::tuple<std::string, timepoint, int64_t>>(sql, before, after))
+        retval.push_back({std::move(channel), day, chrono::seconds{seconds}});
+    return retval;
+}
+
+Database::events Database::search_events(std::string_view query) const
+{
+    auto now = get_time_now();
+    return collect(reader()->query<event>(SEARCH_EVENTS_SQL, now, now, query));
 }
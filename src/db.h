@@ -2,8 +2,16 @@
 
 #include "ics.h"
 #include "sqlite.h"
+#include "relaystatewriter.h"
+#include "eventindex.h"
 #include <vector>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <map>
+#include <set>
+#include <mutex>
+#include <unordered_set>
 #include "utils.h"
 
 class Database
@@ -23,21 +31,163 @@ public:
         bool is_current{false};
     };
     using events = std::vector<event>;
+    struct on_time
+    {
+        std::string channel;
+        timepoint day;
+        chrono::seconds duration;
+    };
+    using event_visitor = std::function<void(const event &)>;
+    static constexpr size_t DEFAULT_READER_POOL_SIZE = 2;
+    static constexpr size_t DEFAULT_PAGE_SIZE = 256;
+    static constexpr int DEFAULT_ARCHIVE_MONTHS = 12;
+
+    // Where fetch_between_page() resumes, in (start, id) order
+    struct page_key
+    {
+        timepoint start{timepoint::min()};
+        int64_t id{-1};
+    };
+
+    struct Options
+    {
+        // Writes go through one WAL connection, reads through a pool of
+        // read-only ones so they never wait for a write transaction.
+        // With 0 everything uses the writer connection.
+        size_t reader_pool_size{DEFAULT_READER_POOL_SIZE};
+        // Work on a copy in memory, loaded from path at startup and written
+        // back by snapshot() and on destruction. Other processes writing to
+        // path in the meantime are overwritten.
+        bool in_memory{false};
+        // update_channel() hands states to a background writer instead of
+        // waiting for the database. Ignored in memory.
+        bool write_behind{false};
+        // Events of the months before the previous one are moved there, in
+        // one database per month (events-YYYY-MM.db), instead of being
+        // deleted. The current window never reads them.
+        std::string archive_dir;
+        // Archived months kept, older partitions are deleted
+        int archive_months{DEFAULT_ARCHIVE_MONTHS};
+    };
+
     Database(std::string_view path);
-    void add_event(const event &ev);
+    Database(std::string_view path, const Options &options);
+    Database(const Database &) = delete;
+    ~Database();
+    bool in_memory() const { return in_memory_; }
+    // Writes the in-memory database back to path
+    void snapshot() const;
+    // Groups the writes done until it is destroyed, update_events() and
+    // the other writers can be nested inside
+    SQLite::Transaction transaction();
+    // False if the same event is already there
+    bool add_event(const event &ev);
     void update_events(const ics::events &ev);
     void update_channel(std::string_view channel, bool state);
+    // Waits until the states given to update_channel() are written
+    void flush_channel_states();
+    // Appends to the relay transition log, through the same background
+    // writer as update_channel()
+    void add_relay_transition(std::string_view channel, bool state);
+    // Adds the transitions of the hours completed since the last call to
+    // the hourly and daily on-time aggregates
+    void rollup_relay_transitions();
     events fetch_all_to_come() const;
+    // From the in-memory index, archived months are left out
     events fetch_between(timepoint before,
                          timepoint after) const;
     events fetch_between(int64_t before, int64_t after) const;
+    // Pages through the database instead of the in-memory index, memory
+    // use does not depend on the range. Archived months are included.
+    void fetch_between(int64_t before,
+                       int64_t after,
+                       const event_visitor &visitor) const;
+    // Rows of at most page_size events following from, with all their
+    // relays, ordered by start and id. from is moved past them, an empty
+    // page means there is nothing left.
+    events fetch_between_page(int64_t before,
+                              int64_t after,
+                              page_key &from,
+                              size_t page_size = DEFAULT_PAGE_SIZE) const;
     events fetch_current() const;
     events fetch_currently_heating() const;
+    // Per channel, the first time after now when one of its heat windows
+    // starts or ends, the only times its heating state can change
+    std::map<std::string, timepoint> fetch_next_transitions() const;
     bool fetch_channel_state(std::string_view channel) const;
     std::vector<std::string> fetch_channel_description(std::string_view channel) const;
     events fetch_earliest_in_future() const;
     size_t current_and_future_events_count() const;
+    // On-time of each channel per local day, for the days starting between
+    // before and after, as of the last rollup
+    std::vector<on_time> fetch_daily_on_time(int64_t before, int64_t after) const;
+    // Events whose room or description match an FTS5 query, such as
+    // "catechisme" or "SALLE : crypte AND ENTETE : bapt*", case and
+    // accents ignored, with their relays if any, ordered by start.
+    // Archived months are left out.
+    events search_events(std::string_view query) const;
+    // Channels whose events or heat windows changed since the last call,
+    // written through this Database or committed by another process
+    std::set<std::string> take_changed_channels();
+    // Logs a warning for each hot query whose plan scans the whole events
+    // table, returns false if there is any
+    bool check_query_plans() const;
+    // Statistics of the statements run by this process, on every connection
+    SQLite::Profiler::Report sql_profile() const;
+    void reset_sql_profile();
 
 protected:
+    // Read-only connection borrowed from the pool, given back on destruction
+    class Reader
+    {
+    public:
+        Reader(const Database &db, std::unique_ptr<SQLite> connection);
+        Reader(const Reader &) = delete;
+        ~Reader();
+        const SQLite &operator*() const;
+        const SQLite *operator->() const { return &**this; }
+
+    private:
+        const Database &db_;
+        std::unique_ptr<SQLite> connection_;
+    };
+
+    Reader reader() const;
+    // Moves (or deletes) the months before the previous one out of the
+    // events table, then applies the archive retention
+    void archive_past_months();
+    // Archive partitions by month (YYYY-MM), oldest first
+    std::map<std::string, std::string> archive_partitions() const;
+    void sync_events(const ics::events &ics_events);
+    // Locks index_, bringing it up to date with the last commit first
+    std::unique_lock<std::mutex> lock_index() const;
+    // Both collect the channels they change in changed_channels_
+    void load_index() const;
+    void apply_written_events() const;
+    // COUNT of schedule_changes, left as it is by writes of relay states
+    int64_t schedule_changes() const;
+    void load_relay_states() const;
+
+    std::string path_;
+    std::string archive_dir_;
+    int archive_months_;
+    bool in_memory_;
+    size_t reader_pool_size_;
+    std::shared_ptr<SQLite::Profiler> profiler_;
     SQLite sql_;
+    mutable std::mutex readers_mutex_;
+    mutable std::vector<std::unique_ptr<SQLite>> readers_;
+    std::unique_ptr<RelayStateWriter> relay_state_writer_;
+    // Serves fetch_current(), fetch_currently_heating() and fetch_between()
+    // from memory. Events written through sql_ (seen by its update hook)
+    // are reloaded one by one, a commit from another connection (seen in
+    // PRAGMA data_version) reloads it entirely, or only the relay states
+    // when schedule_changes did not move.
+    mutable std::mutex index_mutex_;
+    mutable EventIndex index_;
+    mutable bool index_stale_{true};
+    mutable int64_t index_data_version_{0};
+    mutable int64_t index_schedule_changes_{0};
+    mutable std::unordered_set<int64_t> written_events_;
+    mutable std::set<std::string> changed_channels_;
 };
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <curl/curl.h>
+#include "download.h"
+
+using json = nlohmann::json;
+
+static size_t writeMemoryCallback(void *contents, size_t size, size_t nmemb,
+                                  void *userp)
+{
+    size_t realsize = size * nmemb;
+    auto &mem = *static_cast<std::string *>(userp);
+    mem.append(static_cast<char *>(contents), realsize);
+    return realsize;
+}
+
+namespace
+{
+    struct request
+    {
+        request(std::string_view url,
+                const std::map<std::string_view, std::string_view> &headers,
+                const json &payload)
+            : url(url)
+        {
+            // Not thread safe
+            static std::once_flag curl_initialised;
+            std::call_once(curl_initialised, []()
+                           { curl_global_init(CURL_GLOBAL_ALL); });
+
+            handle = curl_easy_init();
+            if (!handle)
+                throw std::runtime_error("Impossible to retrieve " + this->url + " : curl_easy_init failed");
+            curl_easy_setopt(handle, CURLOPT_VERBOSE, 0L);
+            curl_easy_setopt(handle, CURLOPT_URL, this->url.c_str());
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeMemoryCallback);
+            curl_easy_setopt(handle, CURLOPT_WRITEDATA, &result);
+            curl_easy_setopt(handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+            // A stuck server must not keep the transfer forever
+            curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 10L);
+            curl_easy_setopt(handle, CURLOPT_TIMEOUT, 60L);
+
+            // added options that may be required
+            curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);  // redirects
+            curl_easy_setopt(handle, CURLOPT_HTTPPROXYTUNNEL, 1L); // corp. proxies etc.
+            // curl_easy_setopt(handle, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
+
+            for (const auto &[key, value] : headers)
+            {
+                std::ostringstream sstr;
+                sstr << key << ": " << value;
+                curl_headers = curl_slist_append(curl_headers, sstr.str().c_str());
+            }
+            if (!payload.empty())
+            {
+                curl_headers = curl_slist_append(curl_headers, "Content-Type: application/json");
+                std::ostringstream sstr;
+                sstr << payload;
+                payload_str = sstr.str();
+                curl_easy_setopt(handle, CURLOPT_POSTFIELDS, payload_str.c_str());
+            }
+            if (curl_headers)
+                curl_easy_setopt(handle, CURLOPT_HTTPHEADER, curl_headers);
+        }
+        request(const request &) = delete;
+        ~request()
+        {
+            curl_slist_free_all(curl_headers);
+            curl_easy_cleanup(handle);
+        }
+
+        std::string url;
+        CURL *handle{nullptr};
+        struct curl_slist *curl_headers{nullptr};
+        std::string payload_str;
+        std::string result;
+    };
+
+    // Awaits the end of one request, libcurl telling through its callbacks
+    // which sockets and when the reactor has to wake it up for
+    class transfer
+    {
+    public:
+        transfer(Reactor &reactor, request &r)
+            : reactor_(reactor), request_(r), multi_(curl_multi_init())
+        {
+            if (!multi_)
+                throw std::runtime_error("Impossible to retrieve " + r.url + " : curl_multi_init failed");
+            timer_ = reactor_.add_timeout("Download", [this]()
+                                          { act(CURL_SOCKET_TIMEOUT); });
+            curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, on_socket);
+            curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, on_timer);
+            curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this);
+            curl_multi_add_handle(multi_, request_.handle);
+        }
+        transfer(const transfer &) = delete;
+        ~transfer()
+        {
+            for (auto fd : sockets_)
+                reactor_.remove(fd);
+            reactor_.remove(timer_);
+            curl_multi_remove_handle(multi_, request_.handle);
+            curl_multi_cleanup(multi_);
+        }
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> coroutine)
+        {
+            act(CURL_SOCKET_TIMEOUT);
+            if (done_)
+                return false;
+            coroutine_ = coroutine;
+            return true;
+        }
+        CURLcode await_resume() const noexcept { return result_; }
+
+    protected:
+        static int on_socket(CURL *, curl_socket_t fd, int what, void *userp, void *)
+        {
+            auto &self = *static_cast<transfer *>(userp);
+            if (self.sockets_.erase(fd))
+                self.reactor_.remove(fd);
+            if (what == CURL_POLL_REMOVE)
+                return 0;
+            self.reactor_.add_fd(
+                "Download",
+                fd,
+                [&self, fd]()
+                { self.act(fd); },
+                what == CURL_POLL_IN    ? Reactor::interest::read
+                : what == CURL_POLL_OUT ? Reactor::interest::write
+                                        : Reactor::interest::read_write);
+            self.sockets_.insert(fd);
+            return 0;
+        }
+
+        static int on_timer(CURLM *, long timeout_ms, void *userp)
+        {
+            auto &self = *static_cast<transfer *>(userp);
+            self.reactor_.set_timeout(self.timer_,
+                                      timeout_ms < 0
+                                          ? chrono::nanoseconds::max()
+                                          : chrono::milliseconds{timeout_ms});
+            return 0;
+        }
+
+        void act(curl_socket_t fd)
+        {
+            int running;
+            curl_multi_socket_action(multi_, fd, 0, &running);
+            int left;
+            while (auto message = curl_multi_info_read(multi_, &left))
+                if (message->msg == CURLMSG_DONE)
+                {
+                    result_ = message->data.result;
+                    done_ = true;
+                }
+            // The awaiting coroutine may destroy this
+            if (done_ && coroutine_)
+                std::exchange(coroutine_, nullptr).resume();
+        }
+
+        Reactor &reactor_;
+        request &request_;
+        CURLM *multi_;
+        int timer_{-1};
+        std::set<curl_socket_t> sockets_;
+        std::coroutine_handle<> coroutine_;
+        bool done_{false};
+        CURLcode result_{CURLE_OK};
+    };
+
+    task<std::string> perform(Reactor &reactor, std::unique_ptr<request> r)
+    {
+        transfer t{reactor, *r};
+        auto res = co_await t;
+        if (res != CURLE_OK)
+            throw std::runtime_error(
+                "Impossible to retrieve " +
+                r->url +
+                " : " +
+                curl_easy_strerror(res));
+        co_return std::move(r->result);
+    }
+}
+
+task<std::string> download(Reactor &reactor,
+                           std::string_view url,
+                           const std::map<std::string_view, std::string_view> &headers,
+                           const json &payload)
+{
+    return perform(reactor, std::make_unique<request>(url, headers, payload));
+}
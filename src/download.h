@@ -0,0 +1,15 @@
+#pragma once
+#include <map>
+#include <string>
+#include <string_view>
+#include "json.hpp"
+#include "reactor.h"
+#include "task.h"
+
+// Transfers are driven by reactor, many of them can wait for their servers
+// at the same time on its thread. The arguments are copied before the task
+// starts. Throws when the server could not be reached.
+task<std::string> download(Reactor &reactor,
+                           std::string_view url,
+                           const std::map<std::string_view, std::string_view> &headers = {},
+                           const nlohmann::json &payload = {});
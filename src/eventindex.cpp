@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <tuple>
+#include "eventindex.h"
+
+static bool by_start(const EventIndex::entry &a, const EventIndex::entry &b)
+{
+    return std::tie(a.start, a.event_id) < std::tie(b.start, b.event_id);
+}
+
+void EventIndex::clear()
+{
+    relays_.clear();
+    size_ = 0;
+}
+
+void EventIndex::add_relay(relay r)
+{
+    auto id = r.id;
+    relays_[id].info = std::move(r);
+}
+
+void EventIndex::insert(std::vector<entry> entries)
+{
+    std::sort(entries.begin(), entries.end(), by_start);
+    std::map<int64_t, std::vector<entry>> per_relay;
+    for (auto &e : entries)
+        per_relay[e.relay_id].emplace_back(std::move(e));
+
+    for (auto &[relay_id, added] : per_relay)
+    {
+        auto it = relays_.find(relay_id);
+        if (it == relays_.end())
+            continue;
+        auto &r = it->second;
+        for (const auto &e : added)
+        {
+            r.max_lead = std::max(r.max_lead, e.start - e.heat_start);
+            r.max_tail = std::max(r.max_tail, std::max(e.heat_end, e.end) - e.start);
+        }
+        auto middle = r.entries.size();
+        size_ += added.size();
+        r.entries.insert(r.entries.end(),
+                         std::make_move_iterator(added.begin()),
+                         std::make_move_iterator(added.end()));
+        std::inplace_merge(r.entries.begin(), r.entries.begin() + middle, r.entries.end(), by_start);
+    }
+}
+
+void EventIndex::erase(const std::unordered_set<int64_t> &event_ids)
+{
+    if (event_ids.empty())
+        return;
+    for (auto &[relay_id, r] : relays_)
+    {
+        size_ -= std::erase_if(r.entries,
+                               [&](const entry &e)
+                               {
+                                   return event_ids.contains(e.event_id);
+                               });
+        update_bounds(r);
+    }
+}
+
+void EventIndex::set_state(std::string_view channel, bool state)
+{
+    for (auto &[relay_id, r] : relays_)
+        if (r.info.channel == channel)
+            r.info.state = state;
+}
+
+std::set<std::string> EventIndex::channels_of(const std::unordered_set<int64_t> &event_ids) const
+{
+    std::set<std::string> retval;
+    for (const auto &[relay_id, r] : relays_)
+        for (const auto &e : r.entries)
+            if (event_ids.contains(e.event_id))
+            {
+                retval.insert(r.info.channel);
+                break;
+            }
+    return retval;
+}
+
+std::map<std::string, uint64_t> EventIndex::channel_fingerprints() const
+{
+    std::map<std::string, uint64_t> retval;
+    for (const auto &[relay_id, r] : relays_)
+    {
+        // FNV-1a over the fields scheduling depends on
+        auto &hash = retval.try_emplace(r.info.channel, 0xcbf29ce484222325).first->second;
+        auto add = [&](uint64_t value)
+        {
+            for (int i = 0; i < 8; i++, value >>= 8)
+                hash = (hash ^ (value & 0xff)) * 0x100000001b3;
+        };
+        add(relay_id);
+        for (const auto &e : r.entries)
+        {
+            add(e.event_id);
+            add(e.heat_start.time_since_epoch().count());
+            add(e.heat_end.time_since_epoch().count());
+            add(e.start.time_since_epoch().count());
+            add(e.end.time_since_epoch().count());
+            for (unsigned char c : e.description)
+                hash = (hash ^ c) * 0x100000001b3;
+        }
+    }
+    return retval;
+}
+
+void EventIndex::update_bounds(relay_entries &r)
+{
+    r.max_lead = r.max_tail = chrono::seconds{0};
+    for (const auto &e : r.entries)
+    {
+        r.max_lead = std::max(r.max_lead, e.start - e.heat_start);
+        r.max_tail = std::max(r.max_tail, std::max(e.heat_end, e.end) - e.start);
+    }
+}
+
+std::pair<std::vector<EventIndex::entry>::const_iterator, std::vector<EventIndex::entry>::const_iterator>
+EventIndex::started_between(const relay_entries &r, timepoint before, timepoint after)
+{
+    auto first = std::partition_point(r.entries.begin(),
+                                      r.entries.end(),
+                                      [&](const entry &e)
+                                      {
+                                          return e.start < before;
+                                      });
+    auto last = std::partition_point(first,
+                                     r.entries.end(),
+                                     [&](const entry &e)
+                                     {
+                                         return e.start <= after;
+                                     });
+    return {first, last};
+}
+
+void EventIndex::visit_heating(timepoint now, const visitor &v) const
+{
+    for (const auto &[relay_id, r] : relays_)
+    {
+        auto [first, last] = started_between(r, now - r.max_tail, now + r.max_lead);
+        for (auto it = first; it != last; ++it)
+            if (it->heat_start <= now && now <= it->heat_end)
+                v(r.info, *it);
+    }
+}
+
+void EventIndex::visit_current(timepoint now, const visitor &v) const
+{
+    for (const auto &[relay_id, r] : relays_)
+    {
+        auto [first, last] = started_between(r, now - r.max_tail, now + r.max_lead);
+        for (auto it = first; it != last; ++it)
+            if (it->heat_start <= now && now <= it->end)
+                v(r.info, *it);
+    }
+}
+
+std::map<std::string, timepoint> EventIndex::next_boundaries(timepoint now) const
+{
+    std::map<std::string, timepoint> retval;
+    for (const auto &[relay_id, r] : relays_)
+    {
+        auto next = timepoint::max();
+        auto [first, last] = started_between(r, now - r.max_tail, timepoint::max());
+        // Both boundaries of a window are after start - max_lead
+        for (auto it = first; it != last && it->start - r.max_lead <= next; ++it)
+        {
+            if (it->heat_start > now)
+                next = std::min(next, it->heat_start);
+            if (it->heat_end >= now)
+                next = std::min(next, it->heat_end + chrono::seconds{1});
+        }
+        if (next == timepoint::max())
+            continue;
+        if (auto [it, inserted] = retval.emplace(r.info.channel, next); !inserted)
+            it->second = std::min(it->second, next);
+    }
+    return retval;
+}
+
+void EventIndex::visit_between(timepoint before, timepoint after, const visitor &v) const
+{
+    std::vector<std::pair<const relay *, const entry *>> found;
+    for (const auto &[relay_id, r] : relays_)
+    {
+        auto [first, last] = started_between(r, before, after);
+        for (auto it = first; it != last; ++it)
+            found.emplace_back(&r.info, &*it);
+    }
+    std::stable_sort(found.begin(),
+                     found.end(),
+                     [](const auto &a, const auto &b)
+                     {
+                         return by_start(*a.second, *b.second);
+                     });
+    for (const auto &[r, e] : found)
+        v(*r, *e);
+}
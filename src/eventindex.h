@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_set>
+#include <functional>
+#include "utils.h"
+
+// Heat windows of the events kept in memory, per relay and sorted by start,
+// so that "what overlaps now" is answered with binary searches instead of
+// a query. It only mirrors event_relay, callers keep it up to date.
+class EventIndex
+{
+public:
+    struct relay
+    {
+        int64_t id;
+        std::string channel;
+        std::string fullname;
+        bool state{false};
+    };
+
+    struct entry
+    {
+        int64_t event_id;
+        int64_t relay_id;
+        timepoint heat_start;
+        timepoint heat_end;
+        timepoint start;
+        timepoint end;
+        std::string description;
+    };
+
+    using visitor = std::function<void(const relay &, const entry &)>;
+
+    void clear();
+    void add_relay(relay r);
+    void insert(std::vector<entry> entries);
+    void erase(const std::unordered_set<int64_t> &event_ids);
+    void set_state(std::string_view channel, bool state);
+    size_t size() const { return size_; }
+    // Channels of the relays the events are on
+    std::set<std::string> channels_of(const std::unordered_set<int64_t> &event_ids) const;
+    // Hash of the heat windows of each channel, equal in two indexes when
+    // the channel has the same events in both
+    std::map<std::string, uint64_t> channel_fingerprints() const;
+
+    // heat_start <= now <= heat_end
+    void visit_heating(timepoint now, const visitor &v) const;
+    // heat_start <= now <= end
+    void visit_current(timepoint now, const visitor &v) const;
+    // before <= start <= after, ordered by start then event id
+    void visit_between(timepoint before, timepoint after, const visitor &v) const;
+    // Per channel, the first time after now when one of its heat windows
+    // starts or stops (the second after heat_end), channels without any
+    // are left out
+    std::map<std::string, timepoint> next_boundaries(timepoint now) const;
+
+protected:
+    struct relay_entries
+    {
+        relay info;
+        std::vector<entry> entries;
+        // Bounds of heat_start and max(heat_end, end) relative to start,
+        // so that a window containing now has a start in
+        // [now - max_tail, now + max_lead]
+        chrono::seconds max_lead{0};
+        chrono::seconds max_tail{0};
+    };
+
+    static void update_bounds(relay_entries &r);
+    static std::pair<std::vector<entry>::const_iterator, std::vector<entry>::const_iterator>
+    started_between(const relay_entries &r, timepoint before, timepoint after);
+
+    std::map<int64_t, relay_entries> relays_;
+    size_t size_{0};
+};
@@ -9,6 +9,7 @@
 #include "json.hpp"
 #include "frisquetconnect.h"
 #include "utils.h"
+#include "download.h"
 #include "date/date.h"
 #include "date/tz.h"
 
@@ -69,15 +70,17 @@ FrisquetConnect::FrisquetConnect(std::string_view id)
     password_ = fields[1];
     chaudiere_ = fields[2];
     zone_ = fields[3];
-    refresh();
+    Reactor reactor;
+    reactor.run(refresh(reactor, false));
 }
 
-static json json_request(std::string_view url,
-                         const std::map<std::string_view, std::string_view> &headers,
-                         const json &payload)
+static task<json> json_request(Reactor &reactor,
+                               std::string url,
+                               std::map<std::string_view, std::string_view> headers,
+                               json payload)
 {
     TRACE_CALL();
-    auto raw = download(url, headers, payload);
+    auto raw = co_await download(reactor, url, headers, payload);
     DEBUG << raw << std::endl;
 
     auto retval = json::parse(raw);
@@ -86,17 +89,17 @@ static json json_request(std::string_view url,
         throw RequestFailure(url, retval);
     }
 
-    return retval;
+    co_return retval;
 }
 
-static std::string get_new_token(std::string_view email, std::string_view password)
+static task<std::string> get_new_token(Reactor &reactor, std::string email, std::string password)
 {
     json payload = {{"locale", "fr"}, {"email", email}, {"password", password}, {"type_client", "IOS"}};
-    auto res = json_request(AUTH_URL, {}, payload);
-    return res["token"];
+    auto res = co_await json_request(reactor, AUTH_URL, {}, payload);
+    co_return res["token"].get<std::string>();
 }
 
-std::string_view FrisquetConnect::get_token() const
+task<std::string> FrisquetConnect::get_token(Reactor &reactor) const
 {
     TRACE_CALL();
 
@@ -105,7 +108,7 @@ std::string_view FrisquetConnect::get_token() const
     if (now - last_token_time_ > TOKEN_RENEWAL_PERIOD)
     {
         DEBUG << " Token renewal " << std::flush;
-        token_ = get_new_token(email_, password_);
+        token_ = co_await get_new_token(reactor, email_, password_);
         DEBUG << "Ok" << std::endl;
         last_token_time_ = now;
     }
@@ -113,15 +116,15 @@ std::string_view FrisquetConnect::get_token() const
     {
         DEBUG << "No renewal" << std::endl;
     }
-    return token_;
+    co_return token_;
 }
 
-void FrisquetConnect::refresh()
+task<void> FrisquetConnect::refresh(Reactor &reactor)
 {
-    const_cast<const FrisquetConnect *>(this)->refresh(false);
+    co_await const_cast<const FrisquetConnect *>(this)->refresh(reactor, false);
 }
 
-void FrisquetConnect::refresh(bool force_refresh) const
+task<void> FrisquetConnect::refresh(Reactor &reactor, bool force_refresh) const
 {
     TRACE_CALL();
 
@@ -131,9 +134,10 @@ void FrisquetConnect::refresh(bool force_refresh) const
     {
         DEBUG << " infos renewal " << std::flush;
         last_infos_update_time_ = now;
+        auto token = co_await get_token(reactor);
         std::ostringstream sstr;
-        sstr << API_URL << chaudiere_ << "?token=" << get_token();
-        infos_ = json_request(sstr.str(), {}, {});
+        sstr << API_URL << chaudiere_ << "?token=" << token;
+        infos_ = co_await json_request(reactor, sstr.str(), {}, {});
         display_alarm();
         DEBUG << "Ok" << std::endl;
     }
@@ -143,9 +147,10 @@ void FrisquetConnect::refresh(bool force_refresh) const
     }
 }
 
-void FrisquetConnect::set_boiler_mode(mode_e mode)
+task<void> FrisquetConnect::set_boiler_mode(Reactor &reactor, mode_e mode)
 {
-    pass_order({{"SELECTEUR_" + zone_, static_cast<int>(mode)}});
+    std::map<std::string, json> data{{"SELECTEUR_" + zone_, static_cast<int>(mode)}};
+    co_await pass_order(reactor, std::move(data));
 }
 
 FrisquetConnect::program_week FrisquetConnect::get_program_week() const
@@ -199,7 +204,6 @@ FrisquetConnect::mode_e FrisquetConnect::get_boiler_mode() const
 std::string FrisquetConnect::get_timezone() const
 {
     TRACE_CALL();
-    refresh();
     DEBUG << infos_ << std::endl;
     return infos_.at("timezone");
 }
@@ -222,7 +226,6 @@ void FrisquetConnect::display_alarm() const
 
 bool FrisquetConnect::is_boiler_connected() const
 {
-    refresh();
     for (const auto &i : get_alarms())
         if (i.starts_with("Box Frisquet Connect déconnectée"))
             return false;
@@ -254,12 +257,13 @@ bool FrisquetConnect::get() const
     return today[program_index] == 1;
 }
 
-void FrisquetConnect::pass_order(const std::map<std::string, json> &data) const
+task<void> FrisquetConnect::pass_order(Reactor &reactor, std::map<std::string, json> data) const
 {
     TRACE_CALL();
-    refresh(false);
+    co_await refresh(reactor, false);
 
-    auto url = std::string{ORDRES_URL} + chaudiere_ + "?token=" + std::string{get_token()};
+    auto token = co_await get_token(reactor);
+    auto url = std::string{ORDRES_URL} + chaudiere_ + "?token=" + token;
     std::map<std::string_view, std::string_view> headers{
         {"Host", "fcutappli.frisquet.com"},
         {"Accept", "*/*"},
@@ -274,13 +278,13 @@ void FrisquetConnect::pass_order(const std::map<std::string, json> &data) const
     }
 
     INFO << payload.dump() << std::endl;
-    auto response = json_request(url, headers, payload);
+    auto response = co_await json_request(reactor, url, headers, payload);
     INFO << response << std::endl;
 
-    refresh(true);
+    co_await refresh(reactor, true);
 }
 
-void FrisquetConnect::force_set_program(int day, const program_day &pd) const
+task<void> FrisquetConnect::force_set_program(Reactor &reactor, int day, program_day pd) const
 {
     day = day % 7;
     json sub_payload;
@@ -288,10 +292,11 @@ void FrisquetConnect::force_set_program(int day, const program_day &pd) const
     for (auto i : pd)
         sub_payload["plages"].emplace_back(static_cast<int>(i));
     json payload = json::array({sub_payload});
-    pass_order({{"PROGRAMME_" + zone_, payload}});
+    std::map<std::string, json> data{{"PROGRAMME_" + zone_, payload}};
+    co_await pass_order(reactor, std::move(data));
 }
 
-void FrisquetConnect::force_set_program(const program_week &pw) const
+task<void> FrisquetConnect::force_set_program(Reactor &reactor, program_week pw) const
 {
     TRACE_CALL();
     last_whole_week_update_time_ = sc_now();
@@ -306,17 +311,18 @@ void FrisquetConnect::force_set_program(const program_week &pw) const
         payload.emplace_back(day_payload);
     }
 
-    pass_order({{"PROGRAMME_" + zone_, payload}});
+    std::map<std::string, json> data{{"PROGRAMME_" + zone_, payload}};
+    co_await pass_order(reactor, std::move(data));
 }
 
-void FrisquetConnect::set_program_if_necessary(const program_week &pw) const
+task<void> FrisquetConnect::set_program_if_necessary(Reactor &reactor, program_week pw) const
 {
     TRACE_CALL();
 
     auto elapsed = chrono::duration_cast<chrono::seconds>(sc_now() - last_whole_week_update_time_);
     INFO << "Age of Frisquet Information : " << elapsed << std::endl;
 
-    refresh(false);
+    co_await refresh(reactor, false);
     bool program_is_different = get_program_week() != pw;
     if (program_is_different)
         INFO << "Program has changed" << std::endl;
@@ -326,16 +332,18 @@ void FrisquetConnect::set_program_if_necessary(const program_week &pw) const
     if (program_is_too_old || program_is_different)
     {
         INFO << "Force sending information to Frisquet" << std::endl;
-        force_set_program(pw);
+        co_await force_set_program(reactor, pw);
     }
 }
 
-void FrisquetConnect::update_events(const Database::events &events, bool is_inverted)
+task<void> FrisquetConnect::update_events(Reactor &reactor, Database::events events, bool is_inverted)
 {
     TRACE_CALL();
 
+    bool failed = false;
     try
     {
+        co_await refresh(reactor, false);
         DEBUG << " get timezone" << std::endl;
         auto [start_day, day_of_week, program_index] = decompose_now(get_timezone());
         const auto *tz = date::locate_zone(get_timezone());
@@ -368,11 +376,14 @@ void FrisquetConnect::update_events(const Database::events &events, bool is_inve
             INFO << "Boiler " << chaudiere_ << ":" << zone_ << " is not connected, program might be transmitted only later" << std::endl;
 
         DEBUG << "send program" << std::endl;
-        set_program_if_necessary(pw);
+        co_await set_program_if_necessary(reactor, pw);
     }
     catch (std::exception &e)
     {
         INFO << " failed : " << e.what() << std::endl;
-        refresh(true);
+        failed = true;
     };
+    // co_await is not allowed in a handler
+    if (failed)
+        co_await refresh(reactor, true);
 }
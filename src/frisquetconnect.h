@@ -4,6 +4,8 @@
 #include <chrono>
 #include "db.h"
 #include "hwgpio.h"
+#include "reactor.h"
+#include "task.h"
 #include "json_fwd.hpp"
 
 class FrisquetConnect : public HWGpio::GPIOHandler
@@ -22,22 +24,25 @@ public:
 
     FrisquetConnect(std::string_view id);
     // void set(bool);
+    // From the infos of the last refresh
     bool get() const override;
-    void refresh() override;
-    void refresh(bool force_refresh = false) const;
-    std::string_view get_token() const;
-    void set_boiler_mode(mode_e mode);
+    task<void> refresh(Reactor &reactor) override;
+    task<void> refresh(Reactor &reactor, bool force_refresh) const;
+    task<std::string> get_token(Reactor &reactor) const;
+    task<void> set_boiler_mode(Reactor &reactor, mode_e mode);
     mode_e get_boiler_mode() const;
     std::vector<std::string> get_alarms() const;
     void display_alarm() const;
+    // From the infos of the last refresh
     bool is_boiler_connected() const;
-    void pass_order(const std::map<std::string, json> &data) const;
-    void force_set_program(int day, const program_day &pd) const; // Monday = 1
-    void force_set_program(const program_week &pw) const;         // Monday, Tuesday, Wednesday...
-    void set_program_if_necessary(const program_week &pw) const;  // Monday, Tuesday, Wednesday...
-    program_week get_program_week() const;                        // Monday, Tuesday, Wednesday...
+    task<void> pass_order(Reactor &reactor, std::map<std::string, json> data) const;
+    task<void> force_set_program(Reactor &reactor, int day, program_day pd) const; // Monday = 1
+    task<void> force_set_program(Reactor &reactor, program_week pw) const;         // Monday, Tuesday, Wednesday...
+    task<void> set_program_if_necessary(Reactor &reactor, program_week pw) const;  // Monday, Tuesday, Wednesday...
+    program_week get_program_week() const;                                         // Monday, Tuesday, Wednesday...
     program_day get_program_day(int day_of_week) const;
-    void update_events(const Database::events &events, bool is_inverted) override;
+    task<void> update_events(Reactor &reactor, Database::events events, bool is_inverted) override;
+    // From the infos of the last refresh
     std::string get_timezone() const;
 
 protected:
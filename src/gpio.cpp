@@ -5,6 +5,7 @@
 #include "gpio.h"
 #include "hwgpio.h"
 #include "utils.h"
+#include "log.h"
 
 GPIO::GPIO(Database &db, std::string_view path) : db_(db)
 {
@@ -42,21 +43,61 @@ void GPIO::dispatch_events(const Database::events &events)
         dispatch[e.channel].emplace_back(e);
 
     for (const auto &[channel, events] : dispatch)
-        if (channel_name_to_hw_gpio_.count(channel))
-            channel_name_to_hw_gpio_[channel].update_events(events);
+        if (auto it = channel_name_to_hw_gpio_.find(channel); it != channel_name_to_hw_gpio_.end())
+            run_remote(it->first,
+                       "update_events",
+                       [&hw = it->second, events](Reactor &reactor)
+                       { return hw.update_events(reactor, events); });
+}
+
+void GPIO::dispatch_events(const Database::events &events, const std::set<std::string> &channels)
+{
+    std::map<Channel, Database::events> dispatch;
+    for (const auto &channel : channels)
+        dispatch[channel];
+    for (const auto &e : events)
+        if (auto it = dispatch.find(e.channel); it != dispatch.end())
+            it->second.emplace_back(e);
+
+    for (const auto &[channel, events] : dispatch)
+        if (auto it = channel_name_to_hw_gpio_.find(channel); it != channel_name_to_hw_gpio_.end())
+            run_remote(it->first,
+                       "update_events",
+                       [&hw = it->second, events](Reactor &reactor)
+                       { return hw.update_events(reactor, events); });
 }
 
 void GPIO::refresh_channels()
 {
     for (auto &[channel, gpio] : channel_name_to_hw_gpio_)
-        gpio.refresh();
+        run_remote(channel,
+                   "refresh",
+                   [&hw = gpio](Reactor &reactor)
+                   { return hw.refresh(reactor); });
+}
+
+void GPIO::run_remote(Channel channel, std::string_view name, TaskQueue::job work)
+{
+    if (tasks_)
+    {
+        tasks_->run(channel, name, std::move(work));
+        return;
+    }
+    Reactor reactor;
+    reactor.run(work(reactor));
 }
 
 void GPIO::update_channels(const Database::events &events)
+{
+    update_channels(events, channels_);
+}
+
+void GPIO::update_channels(const Database::events &events, const std::set<std::string> &channels)
 {
     std::map<Channel, bool> new_state;
     for (auto channel : channel_list())
-        new_state[channel] = false;
+        if (channels.contains(std::string{channel}))
+            new_state[channel] = false;
     for (const auto &e : events)
         if (auto it = new_state.find(e.channel);
             it != new_state.end())
@@ -68,7 +109,8 @@ void GPIO::update_channels(const Database::events &events)
 
 void GPIO::set_channel(Channel channel, bool state)
 {
-    if (state != state_.at(channel))
+    auto previous = state_.at(channel);
+    if (state != previous)
         std::cout
             << "Setting "
             << channel
@@ -76,10 +118,21 @@ void GPIO::set_channel(Channel channel, bool state)
             << state
             << std::endl;
 
-    db_.update_channel(channel, state);
+    // The relay first, the database must not delay nor prevent it
+    channel_name_to_hw_gpio_[channel].set(state);
     state_[channel] = state;
 
-    return channel_name_to_hw_gpio_[channel].set(state);
+    try
+    {
+        // Not a transition when the previous state is unknown, at start
+        if (state != previous && previous != -1)
+            db_.add_relay_transition(channel, state);
+        db_.update_channel(channel, state);
+    }
+    catch (std::exception &e)
+    {
+        ERROR << "Impossible to save state of " << channel << " : " << e.what() << std::endl;
+    }
 }
 
 bool GPIO::get_hw_channel(Channel channel) const
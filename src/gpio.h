@@ -5,6 +5,7 @@
 #include <string>
 #include <string_view>
 #include "hwgpio.h"
+#include "taskqueue.h"
 
 class GPIO
 {
@@ -14,16 +15,29 @@ public:
     void set_channel(Channel channel, bool state);
     void check_channel_or_throw(Channel channel) const;
     bool get_hw_channel(Channel channel) const;
+    // As last set by this process, -1 before
+    int channel_state(Channel channel) const { return state_.at(channel); }
     void update_channels(const Database::events &events);
+    // Only for the given channels, those without events are switched off
+    // or given an empty programme
+    void update_channels(const Database::events &events, const std::set<std::string> &channels);
     void dispatch_events(const Database::events &events);
+    void dispatch_events(const Database::events &events, const std::set<std::string> &channels);
     void refresh_channels();
+    // Programmes and refreshes, which may wait for remote services, are
+    // then queued (one at a time per channel) instead of waited for.
+    // Switching relays never goes through it.
+    void run_remote_work_on(TaskQueue &tasks) { tasks_ = &tasks; }
 
     std::vector<Channel> channel_list() const;
     void force_sync();
 
 protected:
+    void run_remote(Channel channel, std::string_view name, TaskQueue::job work);
+
     std::map<Channel, HWGpio, std::less<>> channel_name_to_hw_gpio_;
-    Database db_;
+    Database &db_;
     std::set<std::string> channels_;
     std::map<Channel, int, std::less<>> state_;
+    TaskQueue *tasks_{nullptr};
 };
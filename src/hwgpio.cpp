@@ -71,14 +71,14 @@ bool HWGpio::get() const
     return value;
 }
 
-void HWGpio::update_events(const Database::events &events)
+task<void> HWGpio::update_events(Reactor &reactor, Database::events events)
 {
-    impl_->update_events(events, is_inverted_);
+    return impl_->update_events(reactor, std::move(events), is_inverted_);
 }
 
-void HWGpio::refresh()
+task<void> HWGpio::refresh(Reactor &reactor)
 {
-    impl_->refresh();
+    return impl_->refresh(reactor);
 }
 
 bool HWGpio::RawGPIO::get() const
@@ -4,6 +4,8 @@
 #include <memory>
 
 #include "db.h"
+#include "reactor.h"
+#include "task.h"
 
 class HWGpio
 {
@@ -13,16 +15,17 @@ public:
     HWGpio();
     bool get() const;
     void set(bool st);
-    void update_events(const Database::events &events);
-    void refresh();
+    // Both may wait for remote services, through reactor
+    task<void> update_events(Reactor &reactor, Database::events events);
+    task<void> refresh(Reactor &reactor);
 
     struct GPIOHandler
     {
         GPIOHandler(std::string = "") {}
         virtual bool get() const { return false; }
         virtual void set(bool) {}
-        virtual void update_events(const Database::events &, bool) {}
-        virtual void refresh() {}
+        virtual task<void> update_events(Reactor &, Database::events, bool) { co_return; }
+        virtual task<void> refresh(Reactor &) { co_return; }
     };
 
     static std::unique_ptr<GPIOHandler> make_impl(Channel);
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <charconv>
 #include <stdexcept>
 #include <chrono>
 #ifndef __cpp_lib_format
@@ -16,12 +17,19 @@ namespace std
 #include <sstream>
 #include "ics.h"
 #include "utils.h"
+#include "download.h"
 
 namespace ics
 {
     static timepoint parse_tp(std::string_view s, std::string_view timezone)
     {
         std::istringstream sstr{std::string{s}};
+        if (s.ends_with('Z'))
+        {
+            date::sys_seconds utc_tp;
+            sstr >> date::parse(std::string{"%Y%m%dT%H%M%S"}, utc_tp);
+            return utc_tp;
+        }
         date::local_seconds local_tp;
         sstr >> date::parse(std::string{"%Y%m%dT%H%M%S"}, local_tp);
 
@@ -64,6 +72,18 @@ namespace ics
                 current_vevent.summary = t.value;
             else if (t.key == "STATUS")
                 current_vevent.status = t.value;
+            else if (t.key == "UID")
+                current_vevent.uid = t.value;
+            else if (t.key == "SEQUENCE")
+            {
+                // Left at 0 when malformed, the event is still imported
+                current_vevent.sequence = 0;
+                std::from_chars(t.value.data(),
+                                t.value.data() + t.value.size(),
+                                current_vevent.sequence);
+            }
+            else if (t.key == "LAST-MODIFIED")
+                current_vevent.last_modified = parse_tp(t.value, timezone);
         }
         return retval;
     }
@@ -103,12 +123,14 @@ namespace ics
         return retval;
     }
 
-    events fetch_from_uri(std::string_view path)
+    task<events> fetch_from_uri(Reactor &reactor, std::string path)
     {
-        auto t = path.starts_with("file://")
-                     ? cat(std::string{path.substr(7)})
-                     : download(path);
+        std::string t;
+        if (path.starts_with("file://"))
+            t = cat(path.substr(7));
+        else
+            t = co_await download(reactor, path);
         auto tokens = split(t);
-        return parse_events(tokens);
+        co_return parse_events(tokens);
     }
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <vector>
 #include <string_view>
 #include "utils.h"
+#include "reactor.h"
+#include "task.h"
 namespace ics
 {
     struct vevent
@@ -13,6 +15,11 @@ namespace ics
         std::string summary;
         std::string status;
         std::string location;
+        // Same uid for every version of an event, newer versions have a
+        // greater sequence or, with the same one, a later last_modified
+        std::string uid;
+        int64_t sequence{0};
+        timepoint last_modified;
     };
 
     struct events
@@ -21,5 +28,5 @@ namespace ics
         std::vector<vevent> events;
     };
 
-    events fetch_from_uri(std::string_view path);
+    task<events> fetch_from_uri(Reactor &reactor, std::string path);
 }
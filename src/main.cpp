@@ -4,16 +4,28 @@
 #include <string_view>
 #include <string>
 #include <unistd.h>
+#include <csignal>
+#include <map>
+#include <set>
+#include <sstream>
 #include "ics.h"
 #include <chrono>
 #include "date/date.h"
 #include "date/tz.h"
 #include "utils.h"
 #include "log.h"
+#include "reactor.h"
+#include "taskqueue.h"
+#include "control.h"
 
 #define SQLITE_PATH "SQLITE_PATH"
 #define GPIO_CFG "GPIO_CFG"
 #define ENORIA_URI "ENORIA_URI"
+#define SQLITE_IN_MEMORY "SQLITE_IN_MEMORY"
+#define SQLITE_SNAPSHOT_PERIOD_MIN "SQLITE_SNAPSHOT_PERIOD_MIN"
+#define SQLITE_ARCHIVE_DIR "SQLITE_ARCHIVE_DIR"
+#define SQLITE_ARCHIVE_MONTHS "SQLITE_ARCHIVE_MONTHS"
+#define CONTROL_SOCKET "CONTROL_SOCKET"
 
 using namespace std::chrono_literals;
 using namespace date;
@@ -30,40 +42,107 @@ static int help(std::string_view name)
            "--api-list-channels|"
            "--api-list-events BEFORE AFTER|"
            "--api-list-current-events|"
+           "--api-list-on-time BEFORE AFTER|"
+           "--api-search-events QUERY|"
+           "--sql-profile|"
            "--list-events]"
         << std::endl;
     return 1;
 }
 
-static void print_events_csv(const Database::events &events)
+static void print_events_csv_header()
 {
     RAW << "id;channel;description;start;end;is_current" << std::endl;
+}
+
+static void print_event_csv(const Database::event &event)
+{
+    RAW
+        << event.id
+        << ";"
+        << event.channel
+        << ";"
+        << event.description
+        << ";"
+        << event.start
+        << ";"
+        << event.end
+        << ";"
+        << event.is_current
+        << '\n';
+}
+
+static void print_events_csv(const Database::events &events)
+{
+    print_events_csv_header();
     for (const auto &event : events)
+        print_event_csv(event);
+    RAW << std::flush;
+}
+
+static std::string one_line(std::string_view sql)
+{
+    std::string retval;
+    for (auto c : sql)
     {
+        bool blank = c == ' ' || c == '\n' || c == '\t';
+        if (!blank)
+            retval += c;
+        else if (!retval.empty() && retval.back() != ' ')
+            retval += ' ';
+    }
+    return retval;
+}
+
+static void log_sql_profile(const SQLite::Profiler::Report &report)
+{
+    for (const auto &[sql, stats] : report)
+        INFO
+            << stats.count << " runs, "
+            << stats.rows << " rows, "
+            << chrono::duration_cast<chrono::microseconds>(stats.total).count() << "us total, "
+            << chrono::duration_cast<chrono::microseconds>(stats.max).count() << "us max : "
+            << one_line(sql)
+            << std::endl;
+}
+
+static void print_sql_profile_csv(const SQLite::Profiler::Report &report)
+{
+    RAW << "count;rows;total_us;max_us;sql" << std::endl;
+    for (const auto &[sql, stats] : report)
         RAW
-            << event.id
-            << ";"
-            << event.channel
+            << stats.count
             << ";"
-            << event.description
+            << stats.rows
             << ";"
-            << event.start
+            << chrono::duration_cast<chrono::microseconds>(stats.total).count()
             << ";"
-            << event.end
+            << chrono::duration_cast<chrono::microseconds>(stats.max).count()
             << ";"
-            << event.is_current
+            << one_line(sql)
             << std::endl;
-    }
 }
 
-static int api_list_channels()
+// Next to the database by default, so that the daemon and the tools
+// sharing its configuration find each other
+static std::string control_socket_path()
 {
-    RAW << "channel;description;state" << std::endl;
-    Database db{env::get(SQLITE_PATH, "test.db")};
-    GPIO gpio{db, env::get(GPIO_CFG, "gpio.cfg")};
+    return std::string{env::get(CONTROL_SOCKET, std::string{env::get(SQLITE_PATH, "test.db")} + ".sock")};
+}
+
+// The state the daemon set, or the stored one when gpio is not the daemon's
+static int channel_state(const Database &db, const GPIO &gpio, GPIO::Channel channel)
+{
+    auto state = gpio.channel_state(channel);
+    return state < 0 ? db.fetch_channel_state(channel) : state;
+}
+
+static std::string channels_csv(const Database &db, const GPIO &gpio)
+{
+    std::ostringstream out;
+    out << "channel;description;state\n";
     for (auto channel : gpio.channel_list())
     {
-        auto state = db.fetch_channel_state(channel);
         std::string description;
         for (auto d : db.fetch_channel_description(channel))
         {
@@ -71,21 +150,37 @@ static int api_list_channels()
                 description += '/';
             description += d;
         }
-        RAW
+        out
             << channel
             << ";"
             << description
             << ";"
-            << state
-            << std::endl;
+            << channel_state(db, gpio, channel)
+            << '\n';
     }
+    return out.str();
+}
+
+static int api_list_channels()
+{
+    auto answer = control::ask(control_socket_path(), "list-channels");
+    if (!answer)
+    {
+        Database db{env::get(SQLITE_PATH, "test.db")};
+        GPIO gpio{db, env::get(GPIO_CFG, "gpio.cfg")};
+        answer = channels_csv(db, gpio);
+    }
+    RAW << *answer << std::flush;
     return 1;
 }
 
 static int api_list_events(std::string before, std::string after)
 {
-    Database db{env::get(SQLITE_PATH, "test.db")};
-    print_events_csv(db.fetch_between(std::stoll(before), std::stoll(after)));
+    Database db{env::get(SQLITE_PATH, "test.db"),
+                {.archive_dir = std::string{env::get(SQLITE_ARCHIVE_DIR, "")}}};
+    print_events_csv_header();
+    db.fetch_between(std::stoll(before), std::stoll(after), print_event_csv);
+    RAW << std::flush;
     return 1;
 }
 
@@ -96,6 +191,38 @@ static int api_list_current_events()
     return 1;
 }
 
+static int api_list_on_time(std::string before, std::string after)
+{
+    Database db{env::get(SQLITE_PATH, "test.db")};
+    RAW << "channel;day;on_seconds" << std::endl;
+    for (const auto &t : db.fetch_daily_on_time(std::stoll(before), std::stoll(after)))
+        RAW << t.channel << ";" << t.day << ";" << t.duration.count() << '\n';
+    RAW << std::flush;
+    return 1;
+}
+
+static int api_search_events(std::string query)
+{
+    Database db{env::get(SQLITE_PATH, "test.db")};
+    RAW << "id;room;channel;description;start;end" << std::endl;
+    for (const auto &e : db.search_events(query))
+        RAW
+            << e.id
+            << ";"
+            << e.room
+            << ";"
+            << e.channel
+            << ";"
+            << e.description
+            << ";"
+            << e.start
+            << ";"
+            << e.end
+            << '\n';
+    RAW << std::flush;
+    return 1;
+}
+
 static auto to_locale(auto sys_time)
 {
     return date::zoned_seconds{
@@ -103,138 +230,268 @@ static auto to_locale(auto sys_time)
         std::chrono::floor<std::chrono::seconds>(sys_time)};
 }
 
+static std::string describe_event(const Database::event &e)
+{
+    std::ostringstream out;
+    out
+        << "    "
+        << "Event '" << e.description
+        << "' in room '" << e.room
+        << "' from '" << to_locale(e.start)
+        << "' to '" << to_locale(e.end)
+        << "' on channel '" << e.channel
+        << "' (heating time '" << to_locale(e.heat_start)
+        << "'-'" << to_locale(e.heat_end)
+        << "')";
+    return out.str();
+}
+
 static void print_events(const Database::events &events)
 {
     for (const auto &e : events)
-        INFO
-            << "    "
-            << "Event '" << e.description
-            << "' in room '" << e.room
-            << "' from '" << to_locale(e.start)
-            << "' to '" << to_locale(e.end)
-            << "' on channel '" << e.channel
-            << "' (heating time '" << to_locale(e.heat_start)
-            << "'-'" << to_locale(e.heat_end)
-            << "')" << std::endl;
+        INFO << describe_event(e) << std::endl;
+}
+
+static void print_lines(std::string_view text)
+{
+    for (auto line : split(text, '\n'))
+        if (!line.empty())
+            INFO << line << std::endl;
+}
+
+static std::string status_report(const Database &db, const GPIO &gpio)
+{
+    std::ostringstream out;
+    for (auto channel : gpio.channel_list())
+        out
+            << "channel "
+            << channel
+            << " has state "
+            << channel_state(db, gpio, channel)
+            << '\n';
+    for (const auto &e : db.fetch_current())
+        out << describe_event(e) << '\n';
+    return out.str();
+}
+
+static std::string hw_report(const GPIO &gpio, std::string_view channel)
+{
+    std::ostringstream out;
+    out
+        << "channel "
+        << channel
+        << " has hardware state "
+        << gpio.get_hw_channel(channel)
+        << '\n';
+    return out.str();
 }
 
 static int automatic()
 {
-    Database db{env::get(SQLITE_PATH, "test.db")};
+    // Before the database starts its writer thread, for the signals to be
+    // blocked there too
+    Reactor reactor;
+    reactor.add_signal(SIGINT, [&]()
+                       { reactor.stop(); });
+    reactor.add_signal(SIGTERM, [&]()
+                       { reactor.stop(); });
+    // First, a second daemon must not touch the database and the relays
+    control::Server control{reactor, control_socket_path()};
+
+    std::string path{env::get(SQLITE_PATH, "test.db")};
+    Database db{path,
+                {.in_memory = env::get(SQLITE_IN_MEMORY, "0") == "1",
+                 .write_behind = true,
+                 .archive_dir = std::string{env::get(SQLITE_ARCHIVE_DIR, "")},
+                 .archive_months = std::stoi(std::string{env::get(SQLITE_ARCHIVE_MONTHS, "12")})}};
     GPIO gpio{db, env::get(GPIO_CFG, "gpio.cfg")};
-
-    class Timer
+    db.check_query_plans();
+    // Network work is done by coroutines on the reactor thread, which is
+    // the only one using db and switching relays
+    TaskQueue tasks{reactor};
+    gpio.run_remote_work_on(tasks);
+
+    // The command line tools ask the daemon when it runs, instead of
+    // opening the database and the hardware themselves
+    control.add_command("list-channels",
+                        [&](const auto &)
+                        { return channels_csv(db, gpio); });
+    control.add_command("read-status",
+                        [&](const auto &)
+                        { return status_report(db, gpio); });
+    control.add_command("read-hw",
+                        [&](const std::vector<std::string_view> &args)
+                        {
+                            if (args.size() != 1)
+                                throw std::runtime_error("read-hw takes a channel");
+                            gpio.check_channel_or_throw(args[0]);
+                            return hw_report(gpio, args[0]);
+                        });
+
+    // Heating states only change at the boundaries of heat windows : a
+    // channel is updated when its next one is reached, and when its events
+    // change, through the calendar or another process such as
+    // --program-event. The boundaries are computed again after either.
+    // Channels that could not be updated are tried again a minute later.
+    std::map<std::string, timepoint> next_transitions;
+    std::set<std::string> failed_channels;
+    int transition_timer = -1;
+    auto update_channels = [&](std::set<std::string> channels)
     {
-    public:
-        Timer(std::string_view name,
-              chrono::duration<long> period,
-              std::function<void()> lambda)
-            : name_(name),
-              lambda_(lambda),
-              period_(period)
+        channels.insert(failed_channels.begin(), failed_channels.end());
+        failed_channels.clear();
+        try
+        {
+            auto current_state = db.fetch_currently_heating();
+            print_events(current_state);
+            gpio.update_channels(current_state, channels);
+            next_transitions = db.fetch_next_transitions();
+        }
+        catch (...)
         {
+            failed_channels = std::move(channels);
+            reactor.set_deadline(transition_timer, get_time_now() + 1min);
+            throw;
         }
+        auto next = timepoint::max();
+        for (const auto &[channel, time] : next_transitions)
+            next = std::min(next, time);
+        reactor.set_deadline(transition_timer, next);
+    };
+    auto update_changed_channels = [&]()
+    {
+        auto channels = db.take_changed_channels();
+        if (channels.empty())
+            return;
+        for (const auto &channel : channels)
+            DEBUG << "Events of channel " << channel << " changed" << std::endl;
+        auto now = get_time_now();
+        gpio.dispatch_events(db.fetch_between(now - 24h, now + 7 * 24h), channels);
+        update_channels(channels);
+    };
 
-        void operator()()
+    transition_timer = reactor.add_deadline(
+        "Update-GPIO",
+        [&]()
         {
-            auto now = chrono::steady_clock::now();
-            if (now - previous_ > period_)
+            auto now = get_time_now();
+            std::set<std::string> due;
+            for (const auto &[channel, time] : next_transitions)
+                if (time <= now)
+                    due.insert(channel);
+            update_channels(due);
+        });
+    auto update_events = [&](const ics::events &events)
+    {
+        INFO << "found " << events.events.size() << " events" << std::endl;
+        db.update_events(events);
+        INFO
+            << db.current_and_future_events_count()
+            << " events are curently in the present or future"
+            << std::endl;
+        INFO
+            << "  Current events" << std::endl;
+        print_events(db.fetch_current());
+        INFO
+            << "  Future events" << std::endl;
+        print_events(db.fetch_earliest_in_future());
+        update_changed_channels();
+    };
+    auto fetch_enoria = [&](Reactor &reactor) -> task<void>
+    {
+        int count = 5;
+        ics::events events;
+        while (1)
+        {
+            try
             {
-                DEBUG << "Timer:" << name_ << std::endl;
-                previous_ = now;
-                try
-                {
-                    lambda_();
-                }
-                catch (std::exception &e)
-                {
-                    ERROR << " failed : " << e.what() << std::endl;
-                }
+                INFO << "Fetching new calendar from Enoria... " << std::flush;
+                events = co_await ics::fetch_from_uri(reactor, std::string{env::get(ENORIA_URI, "http://invalid")});
+                INFO << "Ok!" << std::endl;
+                break;
             }
+            catch (std::exception &e)
+            {
+                ERROR << " failed :\n"
+                      << "    " << e.what() << std::endl;
+                count--;
+                if (count == 0)
+                    throw;
+            }
+            co_await reactor.sleep_for(3s);
         }
-
-    protected:
-        std::string name_;
-        std::function<void()> lambda_;
-        chrono::steady_clock::time_point previous_;
-        chrono::duration<long> period_;
+        update_events(events);
     };
+    reactor.add_periodic(
+        "Fetch-enoria",
+        1h,
+        [&]()
+        {
+            tasks.run("enoria", "Fetch-enoria", fetch_enoria);
+        });
+    // Commits of other processes are written to the database files, ours
+    // as well. Those of the relay state writer cost a PRAGMA data_version
+    // and a reload of the relay states, the events are only reloaded when
+    // schedule_changes moved. In memory, nobody else writes to our copy.
+    if (!db.in_memory())
+        reactor.add_file_watch("Watch-database", path, update_changed_channels);
+    reactor.add_periodic(
+        "Update-programmation",
+        30min,
+        [&]()
+        {
+            auto now = get_time_now();
+            auto events = db.fetch_between(
+                now - 24h,
+                now + 7 * 24h);
+            gpio.dispatch_events(events);
+        });
+    reactor.add_periodic(
+        "Refresh-channels",
+        5min,
+        [&]()
+        {
+            gpio.refresh_channels();
+        });
+    reactor.add_periodic(
+        "Rollup-relay-transitions",
+        1h,
+        [&]()
+        {
+            db.rollup_relay_transitions();
+        });
+    reactor.add_periodic(
+        "Log-SQL-profile",
+        1h,
+        [&]()
+        {
+            INFO << "SQL statements since last report" << std::endl;
+            log_sql_profile(db.sql_profile());
+            db.reset_sql_profile();
+        });
+    if (db.in_memory())
+        reactor.add_periodic(
+            "Snapshot-database",
+            chrono::minutes{std::stoll(std::string{env::get(SQLITE_SNAPSHOT_PERIOD_MIN, "15")})},
+            [&]()
+            {
+                db.snapshot();
+            });
 
-    std::vector<Timer> timers{
-        {"Fetch-enoria",
-         1h,
-         [&]()
-         {
-             int count = 5;
-             ics::events events;
-             while (1)
-             {
-                 try
-                 {
-                     INFO << "Fetching new calendar from Enoria... " << std::flush;
-                     events = ics::fetch_from_uri(env::get(ENORIA_URI, "http://invalid"));
-                     INFO << "Ok!" << std::endl;
-                     break;
-                 }
-                 catch (std::exception &e)
-                 {
-                     ERROR << " failed :\n"
-                           << "    " << e.what() << std::endl;
-                     sleep(3);
-                     count--;
-                     if (count == 0)
-                         throw;
-                 }
-             }
-
-             INFO << "found " << events.events.size() << " events" << std::endl;
-             db.update_events(events);
-             INFO
-                 << db.current_and_future_events_count()
-                 << " events are curently in the present or future"
-                 << std::endl;
-             INFO
-                 << "  Current events" << std::endl;
-             print_events(db.fetch_current());
-             INFO
-                 << "  Future events" << std::endl;
-             print_events(db.fetch_earliest_in_future());
-         }},
-        {"Update-GPIO",
-         1min,
-         [&]()
-         {
-             INFO << "Fetching current events from database... " << std::flush;
-             auto current_state = db.fetch_currently_heating();
-             INFO << "ok" << std::endl;
-             print_events(current_state);
-             gpio.update_channels(current_state);
-         }},
-        {"Update-programmation",
-         30min,
-         [&]()
-         {
-             auto now = get_time_now();
-             auto events = db.fetch_between(
-                 now - 24h,
-                 now + 7 * 24h);
-             gpio.dispatch_events(events);
-         }},
-        {"Refresh-channels",
-         5min,
-         [&]()
-         {
-             gpio.refresh_channels();
-         }}};
-
-    while (1)
+    try
+    {
+        auto channels = gpio.channel_list();
+        update_channels({channels.begin(), channels.end()});
+    }
+    catch (std::exception &e)
     {
-        for (auto &i : timers)
-            i();
-        sleep(1);
+        ERROR << "Updating channels failed : " << e.what() << std::endl;
     }
 
-    return 0; // Should not happen
+    reactor.run();
+
+    INFO << "Stopping" << std::endl;
+    return 0;
 }
 
 static int list_current_and_future_events()
@@ -252,35 +509,44 @@ static int list_current_and_future_events()
     return 0;
 }
 
-static int read_status()
+// Runs the queries of one daemon cycle and reports their cost
+static int sql_profile()
 {
     Database db{env::get(SQLITE_PATH, "test.db")};
-    GPIO gpio{db, env::get(GPIO_CFG, "gpio.cfg")};
-    for (auto channel : gpio.channel_list())
+    db.reset_sql_profile();
+    auto now = get_time_now();
+    db.fetch_currently_heating();
+    db.fetch_between(now - 24h, now + 7 * 24h);
+    db.fetch_current();
+    db.fetch_earliest_in_future();
+    db.current_and_future_events_count();
+    print_sql_profile_csv(db.sql_profile());
+    return 0;
+}
+
+static int read_status()
+{
+    auto answer = control::ask(control_socket_path(), "read-status");
+    if (!answer)
     {
-        auto state = db.fetch_channel_state(channel);
-        INFO
-            << "channel "
-            << channel
-            << " has state "
-            << state
-            << std::endl;
+        Database db{env::get(SQLITE_PATH, "test.db")};
+        GPIO gpio{db, env::get(GPIO_CFG, "gpio.cfg")};
+        answer = status_report(db, gpio);
     }
-    print_events(db.fetch_current());
+    print_lines(*answer);
     return 0;
 }
 
 static int read_hw(std::string_view channel)
 {
-    Database db{env::get(SQLITE_PATH, "test.db")};
-    GPIO gpio{db, env::get(GPIO_CFG, "gpio.cfg")};
-    auto hw_state = gpio.get_hw_channel(channel);
-    INFO
-        << "channel "
-        << channel
-        << " has hardware state "
-        << hw_state
-        << std::endl;
+    auto answer = control::ask(control_socket_path(), "read-hw " + std::string{channel});
+    if (!answer)
+    {
+        Database db{env::get(SQLITE_PATH, "test.db")};
+        GPIO gpio{db, env::get(GPIO_CFG, "gpio.cfg")};
+        answer = hw_report(gpio, channel);
+    }
+    print_lines(*answer);
     return 0;
 }
 
@@ -321,7 +587,11 @@ static int program_event(std::string channel, std::string length_min, char **des
     Database db{env::get(SQLITE_PATH, "test.db")};
     Database::event e{.heat_start = start, .heat_end = end, .start = start, .end = end, .room = channel, .channel = channel, .description = description};
 
-    db.add_event(e);
+    if (!db.add_event(e))
+    {
+        INFO << "Event already programmed" << std::endl;
+        return 0;
+    }
     INFO << "Programming event" << std::endl;
     print_events({e});
     return 0;
@@ -370,6 +640,12 @@ int main(int argc, char **argv, char **envp)
             return api_list_events(argv[1], argv[2]);
         else if (mode == "--api-list-current-events")
             return api_list_current_events();
+        else if (mode == "--api-list-on-time" && argc >= 3)
+            return api_list_on_time(argv[1], argv[2]);
+        else if (mode == "--api-search-events" && argc >= 2)
+            return api_search_events(argv[1]);
+        else if (mode == "--sql-profile")
+            return sql_profile();
         else
             return help(tool_name);
     }
@@ -0,0 +1,346 @@
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <filesystem>
+#include <unistd.h>
+#include "reactor.h"
+#include "log.h"
+
+static void throw_errno(std::string_view what)
+{
+    throw std::runtime_error(std::string{what} + " : " + std::strerror(errno));
+}
+
+static timespec to_timespec(chrono::nanoseconds duration)
+{
+    auto seconds = chrono::duration_cast<chrono::seconds>(duration);
+    return {.tv_sec = static_cast<time_t>(seconds.count()),
+            .tv_nsec = static_cast<long>((duration - seconds).count())};
+}
+
+Reactor::Reactor() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC))
+{
+    if (epoll_fd_ < 0)
+        throw_errno("epoll_create1");
+    posted_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (posted_fd_ < 0)
+    {
+        close(epoll_fd_);
+        throw_errno("eventfd");
+    }
+    watch(posted_fd_, "Posted", kind::posted, nullptr);
+}
+
+Reactor::~Reactor()
+{
+    for (const auto &[fd, s] : sources_)
+        if (s.type != kind::fd)
+            close(fd);
+    close(epoll_fd_);
+}
+
+static uint32_t to_epoll(Reactor::interest events)
+{
+    switch (events)
+    {
+    case Reactor::interest::read:
+        return EPOLLIN;
+    case Reactor::interest::write:
+        return EPOLLOUT;
+    case Reactor::interest::read_write:
+        return EPOLLIN | EPOLLOUT;
+    }
+    return EPOLLIN;
+}
+
+void Reactor::watch(int fd, std::string_view name, kind type, handler h,
+                    std::string file, interest events)
+{
+    epoll_event event{.events = to_epoll(events), .data = {.fd = fd}};
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+        throw_errno("epoll_ctl " + std::string{name});
+    sources_[fd] = {std::string{name}, type, std::move(h), std::move(file)};
+}
+
+int Reactor::add_periodic(std::string_view name, chrono::nanoseconds period, handler h)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        throw_errno("timerfd_create " + std::string{name});
+    // A zero it_value would disarm the timer
+    itimerspec spec{.it_interval = to_timespec(period),
+                    .it_value = to_timespec(chrono::nanoseconds{1})};
+    if (timerfd_settime(fd, 0, &spec, nullptr) < 0)
+    {
+        close(fd);
+        throw_errno("timerfd_settime " + std::string{name});
+    }
+    watch(fd, name, kind::periodic, std::move(h));
+    return fd;
+}
+
+int Reactor::add_deadline(std::string_view name, handler h)
+{
+    int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        throw_errno("timerfd_create " + std::string{name});
+    watch(fd, name, kind::deadline, std::move(h));
+    return fd;
+}
+
+void Reactor::set_deadline(int timer, timepoint when)
+{
+    itimerspec spec{};
+    int flags = 0;
+    if (when != timepoint::max())
+    {
+        spec.it_value = to_timespec(std::max(when.time_since_epoch(), chrono::seconds{1}));
+        flags = TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET;
+    }
+    if (timerfd_settime(timer, flags, &spec, nullptr) < 0)
+        throw_errno("timerfd_settime " + sources_.at(timer).name);
+}
+
+int Reactor::add_timeout(std::string_view name, handler h)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        throw_errno("timerfd_create " + std::string{name});
+    watch(fd, name, kind::timeout, std::move(h));
+    return fd;
+}
+
+void Reactor::set_timeout(int timer, chrono::nanoseconds delay)
+{
+    itimerspec spec{};
+    if (delay != chrono::nanoseconds::max())
+        spec.it_value = to_timespec(std::max(delay, chrono::nanoseconds{1}));
+    if (timerfd_settime(timer, 0, &spec, nullptr) < 0)
+        throw_errno("timerfd_settime " + sources_.at(timer).name);
+}
+
+void Reactor::add_signal(int signal, handler h)
+{
+    signal_handlers_[signal] = std::move(h);
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (const auto &entry : signal_handlers_)
+        sigaddset(&mask, entry.first);
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0)
+        throw std::runtime_error("Impossible to block signal " + std::to_string(signal));
+
+    bool first = signal_fd_ < 0;
+    signal_fd_ = signalfd(signal_fd_, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd_ < 0)
+        throw_errno("signalfd");
+    if (first)
+        watch(signal_fd_, "Signals", kind::signal, nullptr);
+}
+
+void Reactor::add_fd(std::string_view name, int fd, handler h, interest events)
+{
+    watch(fd, name, kind::fd, std::move(h), {}, events);
+}
+
+int Reactor::add_file_watch(std::string_view name, const std::string &path, handler h)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        throw_errno("inotify_init1 " + std::string{name});
+    // The directory is watched, files in it can be created and removed
+    auto file = std::filesystem::path{path};
+    auto directory = file.has_parent_path() ? file.parent_path() : std::filesystem::path{"."};
+    if (inotify_add_watch(fd, directory.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(fd);
+        throw_errno("inotify_add_watch " + directory.string());
+    }
+    watch(fd, name, kind::file_watch, std::move(h), file.filename().string());
+    return fd;
+}
+
+void Reactor::remove(int fd)
+{
+    auto it = sources_.find(fd);
+    if (it == sources_.end())
+        return;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    if (it->second.type != kind::fd)
+        close(fd);
+    sources_.erase(it);
+}
+
+void Reactor::post(handler h)
+{
+    {
+        std::lock_guard lock{posted_mutex_};
+        posted_.emplace_back(std::move(h));
+    }
+    uint64_t one = 1;
+    if (write(posted_fd_, &one, sizeof(one)) < 0)
+        throw_errno("write Posted");
+}
+
+void Reactor::sleep_awaiter::await_suspend(std::coroutine_handle<> coroutine)
+{
+    auto &reactor = reactor_;
+    int timer = reactor.add_timeout("Sleep", nullptr);
+    reactor.sources_.at(timer).h = [&reactor, timer, coroutine]()
+    {
+        reactor.remove(timer);
+        coroutine.resume();
+    };
+    try
+    {
+        reactor.set_timeout(timer, duration_);
+    }
+    catch (...)
+    {
+        reactor.remove(timer);
+        throw;
+    }
+}
+
+void Reactor::fd_awaiter::await_suspend(std::coroutine_handle<> coroutine)
+{
+    auto &reactor = reactor_;
+    int fd = fd_;
+    reactor.add_fd(
+        "Await",
+        fd,
+        [&reactor, fd, coroutine]()
+        {
+            reactor.remove(fd);
+            coroutine.resume();
+        },
+        events_);
+}
+
+void Reactor::run()
+{
+    stop_ = false;
+    run_until(stop_);
+}
+
+void Reactor::run_until(const bool &done)
+{
+    while (!done)
+    {
+        epoll_event events[16];
+        int count = epoll_wait(epoll_fd_, events, std::size(events), -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            throw_errno("epoll_wait");
+        for (int i = 0; i < count && !done; i++)
+            dispatch(events[i].data.fd);
+    }
+}
+
+void Reactor::dispatch(int fd)
+{
+    auto it = sources_.find(fd);
+    if (it == sources_.end())
+        return;
+    const auto &s = it->second;
+    // Copied, the handler may remove its own source
+    auto name = s.name;
+    handler h;
+
+    switch (s.type)
+    {
+    case kind::fd:
+        h = s.h;
+        break;
+    case kind::periodic:
+    case kind::deadline:
+    case kind::timeout:
+    {
+        // Expirations missed meanwhile are run only once
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) < 0)
+        {
+            if (errno == EAGAIN)
+                return;
+            if (errno != ECANCELED)
+                throw_errno("read " + name);
+            DEBUG << "Clock set, " << name << " is due again" << std::endl;
+        }
+        if (s.type != kind::timeout)
+            DEBUG << "Timer:" << name << std::endl;
+        h = s.h;
+        break;
+    }
+    case kind::signal:
+    {
+        signalfd_siginfo info;
+        if (read(fd, &info, sizeof(info)) != sizeof(info))
+            return;
+        auto found = signal_handlers_.find(static_cast<int>(info.ssi_signo));
+        if (found == signal_handlers_.end())
+            return;
+        name = "Signal " + std::to_string(info.ssi_signo);
+        h = found->second;
+        break;
+    }
+    case kind::posted:
+    {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) < 0)
+            return;
+        std::vector<handler> posted;
+        {
+            std::lock_guard lock{posted_mutex_};
+            posted.swap(posted_);
+        }
+        for (auto &p : posted)
+        {
+            try
+            {
+                p();
+            }
+            catch (std::exception &e)
+            {
+                ERROR << name << " failed : " << e.what() << std::endl;
+            }
+        }
+        return;
+    }
+    case kind::file_watch:
+    {
+        alignas(inotify_event) char buffer[4096];
+        bool written = false;
+        for (auto length = read(fd, buffer, sizeof(buffer));
+             length > 0;
+             length = read(fd, buffer, sizeof(buffer)))
+        {
+            for (auto p = buffer; p < buffer + length;)
+            {
+                auto event = reinterpret_cast<const inotify_event *>(p);
+                if (event->len && std::string_view{event->name}.starts_with(s.file))
+                    written = true;
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+        if (!written)
+            return;
+        h = s.h;
+        break;
+    }
+    }
+
+    try
+    {
+        h();
+    }
+    catch (std::exception &e)
+    {
+        ERROR << name << " failed : " << e.what() << std::endl;
+    }
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <coroutine>
+#include <optional>
+#include <type_traits>
+#include "utils.h"
+#include "task.h"
+
+// Single-threaded event loop on epoll. Timers are timerfds, signals a
+// signalfd, and any other file descriptor can be watched. Handlers run one
+// at a time from run(), an exception thrown by one is logged and the loop
+// goes on. Coroutines wait for it with sleep_for(), readable() and
+// writable(), and are resumed by the thread of run().
+class Reactor
+{
+public:
+    using handler = std::function<void()>;
+    enum class interest
+    {
+        read,
+        write,
+        read_write,
+    };
+
+    class sleep_awaiter
+    {
+    public:
+        bool await_ready() const noexcept { return duration_ <= chrono::nanoseconds::zero(); }
+        void await_suspend(std::coroutine_handle<> coroutine);
+        void await_resume() const noexcept {}
+
+    protected:
+        friend class Reactor;
+        sleep_awaiter(Reactor &reactor, chrono::nanoseconds duration) : reactor_(reactor), duration_(duration) {}
+
+        Reactor &reactor_;
+        chrono::nanoseconds duration_;
+    };
+
+    class fd_awaiter
+    {
+    public:
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> coroutine);
+        void await_resume() const noexcept {}
+
+    protected:
+        friend class Reactor;
+        fd_awaiter(Reactor &reactor, int fd, interest events) : reactor_(reactor), fd_(fd), events_(events) {}
+
+        Reactor &reactor_;
+        int fd_;
+        interest events_;
+    };
+
+    Reactor();
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+    ~Reactor();
+
+    // Calls h every period on the monotonic clock, the first time as soon
+    // as run() starts. Returns the timer, for remove().
+    int add_periodic(std::string_view name, chrono::nanoseconds period, handler h);
+    // Timer on the wall clock, disarmed until set_deadline(). h is also
+    // called when the clock is set, the deadline being then maybe far
+    // from what was meant.
+    int add_deadline(std::string_view name, handler h);
+    // timepoint::max() disarms the timer, a past time fires it at once
+    void set_deadline(int timer, timepoint when);
+    // Blocks the signal for the calling thread, so it has to be called
+    // before starting any other thread (they inherit the mask).
+    void add_signal(int signal, handler h);
+    // Timer on the monotonic clock firing once, disarmed until set_timeout()
+    int add_timeout(std::string_view name, handler h);
+    // chrono::nanoseconds::max() disarms the timer
+    void set_timeout(int timer, chrono::nanoseconds delay);
+    // Calls h whenever fd is ready for events, the caller keeps owning fd
+    void add_fd(std::string_view name, int fd, handler h, interest events = interest::read);
+    // Calls h when path, or a file of its directory whose name starts like
+    // path's (such as SQLite's -wal and -journal), is written
+    int add_file_watch(std::string_view name, const std::string &path, handler h);
+    // Stops watching fd, closing it if the reactor created it
+    void remove(int fd);
+    // From any thread : h is run by the thread of run()
+    void post(handler h);
+
+    // For co_await, fd must not be watched already
+    sleep_awaiter sleep_for(chrono::nanoseconds duration) { return {*this, duration}; }
+    fd_awaiter readable(int fd) { return {*this, fd, interest::read}; }
+    fd_awaiter writable(int fd) { return {*this, fd, interest::write}; }
+
+    // Dispatches until stop() is called
+    void run();
+    // Dispatches until t is over, for its result
+    template <typename T>
+    T run(task<T> t);
+    void stop() { stop_ = true; }
+
+protected:
+    enum class kind
+    {
+        fd,
+        periodic,
+        deadline,
+        timeout,
+        signal,
+        file_watch,
+        posted,
+    };
+    struct source
+    {
+        std::string name;
+        kind type;
+        handler h;
+        // Watched file name, for file_watch
+        std::string file;
+    };
+
+    void watch(int fd, std::string_view name, kind type, handler h,
+               std::string file = {}, interest events = interest::read);
+    void dispatch(int fd);
+    void run_until(const bool &done);
+
+    int epoll_fd_;
+    int signal_fd_{-1};
+    int posted_fd_{-1};
+    std::mutex posted_mutex_;
+    std::vector<handler> posted_;
+    std::map<int, handler> signal_handlers_;
+    std::map<int, source> sources_;
+    bool stop_{false};
+};
+
+template <typename T>
+T Reactor::run(task<T> t)
+{
+    if constexpr (std::is_void_v<T>)
+    {
+        std::exception_ptr failure;
+        bool done = false;
+        spawn(std::move(t),
+              [&](std::exception_ptr e)
+              {
+                  failure = e;
+                  done = true;
+              });
+        run_until(done);
+        if (failure)
+            std::rethrow_exception(failure);
+    }
+    else
+    {
+        std::optional<T> result;
+        run([](task<T> t, std::optional<T> &result) -> task<void>
+            { result.emplace(co_await t); }(std::move(t), result));
+        return std::move(*result);
+    }
+}
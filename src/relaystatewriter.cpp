@@ -0,0 +1,176 @@
+#include "relaystatewriter.h"
+#include <iterator>
+#include "log.h"
+
+RelayStateWriter::RelayStateWriter(std::string_view path,
+                                   const SQLite::Options &options,
+                                   size_t capacity)
+    : sql_(path, options),
+      capacity_(capacity),
+      thread_([this]()
+              { run(); })
+{
+}
+
+RelayStateWriter::~RelayStateWriter()
+{
+    {
+        std::lock_guard lock{mutex_};
+        stop_ = true;
+    }
+    wake_up_.notify_all();
+    thread_.join();
+}
+
+bool RelayStateWriter::push(std::string_view channel, bool state, timepoint when)
+{
+    {
+        std::lock_guard lock{mutex_};
+        auto it = pending_.find(channel);
+        if (it == pending_.end())
+        {
+            if (pending_.size() >= capacity_)
+                return false;
+            it = pending_.emplace(channel, pending_state{}).first;
+        }
+        it->second = {state, when};
+        pushed_++;
+    }
+    wake_up_.notify_all();
+    return true;
+}
+
+bool RelayStateWriter::push_transition(std::string_view channel, bool state, timepoint when)
+{
+    {
+        std::lock_guard lock{mutex_};
+        if (transitions_.size() >= capacity_)
+            return false;
+        transitions_.push_back({std::string{channel}, state, when});
+        pushed_++;
+    }
+    wake_up_.notify_all();
+    return true;
+}
+
+void RelayStateWriter::flush()
+{
+    std::unique_lock lock{mutex_};
+    auto target = pushed_;
+    flush_requested_ = true;
+    wake_up_.notify_all();
+    written_cv_.wait(lock,
+                     [&]()
+                     { return written_ >= target; });
+}
+
+void RelayStateWriter::write(const SQLite &sql,
+                             std::string_view channel,
+                             bool state,
+                             timepoint when)
+{
+    constexpr auto update_sql =
+        "UPDATE relays \n"
+        "SET STATE = ?, LAST_UPDATE = ? \n"
+        "WHERE CHANNEL = ? AND STATE <> ?";
+    sql.exec(update_sql,
+             state,
+             when,
+             channel,
+             state);
+}
+
+void RelayStateWriter::write_transition(const SQLite &sql,
+                                        std::string_view channel,
+                                        bool state,
+                                        timepoint when)
+{
+    constexpr auto insert_sql =
+        "INSERT INTO relay_transitions (CHANNEL, STATE, TIME) \n"
+        "                       VALUES (?,?,?)";
+    sql.exec(insert_sql, channel, state, when);
+}
+
+void RelayStateWriter::write(const batch &states, const std::vector<transition> &transitions)
+{
+    auto transaction = sql_.transaction();
+    for (const auto &t : transitions)
+        write_transition(sql_, t.channel, t.state, t.when);
+    for (const auto &[channel, pending] : states)
+        write(sql_, channel, pending.state, pending.when);
+    transaction.success();
+}
+
+void RelayStateWriter::run()
+{
+    std::unique_lock lock{mutex_};
+    int failures = 0;
+    while (true)
+    {
+        wake_up_.wait(lock,
+                      [&]()
+                      { return stop_ || flush_requested_ || !pending_.empty() || !transitions_.empty(); });
+        if (pending_.empty() && transitions_.empty())
+        {
+            written_ = pushed_;
+            flush_requested_ = false;
+            written_cv_.notify_all();
+            if (stop_)
+                return;
+            continue;
+        }
+
+        // Leave some time for other channels of the same tick to come
+        if (!stop_ && !flush_requested_)
+            wake_up_.wait_for(lock,
+                              BATCH_DELAY,
+                              [&]()
+                              { return stop_ || flush_requested_; });
+
+        batch states;
+        states.swap(pending_);
+        std::vector<transition> transitions;
+        transitions.swap(transitions_);
+        auto count = pushed_;
+        flush_requested_ = false;
+        lock.unlock();
+
+        bool ok = true;
+        try
+        {
+            write(states, transitions);
+        }
+        catch (std::exception &e)
+        {
+            ERROR << "Impossible to save relay states : " << e.what() << std::endl;
+            ok = false;
+        }
+
+        lock.lock();
+        failures = ok ? 0 : failures + 1;
+        if (!ok && failures >= MAX_ATTEMPTS)
+        {
+            ERROR << "Giving up on saving " << states.size() << " relay states and "
+                  << transitions.size() << " transitions" << std::endl;
+            failures = 0;
+        }
+        else if (!ok && !stop_)
+        {
+            // Retry later, unless a newer state has been pushed meanwhile
+            for (auto &[channel, pending] : states)
+                pending_.try_emplace(channel, pending);
+            // Before those pushed meanwhile, the log stays in order
+            transitions.insert(transitions.end(),
+                               std::make_move_iterator(transitions_.begin()),
+                               std::make_move_iterator(transitions_.end()));
+            transitions_ = std::move(transitions);
+            wake_up_.wait_for(lock,
+                              RETRY_DELAY,
+                              [&]()
+                              { return stop_; });
+            continue;
+        }
+        written_ = count;
+        written_cv_.notify_all();
+    }
+}
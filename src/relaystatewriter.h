@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include "sqlite.h"
+#include "utils.h"
+
+// Persists relay states to the relays table, and transitions to their log,
+// from a background thread, so that switching a relay never waits for the
+// database. Successive states of a channel are coalesced, only the last
+// one is written, transitions are all kept.
+class RelayStateWriter
+{
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+    static constexpr auto BATCH_DELAY = std::chrono::milliseconds{200};
+    static constexpr auto RETRY_DELAY = std::chrono::seconds{1};
+    // Attempts at writing a batch before it is dropped
+    static constexpr int MAX_ATTEMPTS = 3;
+
+    RelayStateWriter(std::string_view path,
+                     const SQLite::Options &options,
+                     size_t capacity = DEFAULT_CAPACITY);
+    RelayStateWriter(const RelayStateWriter &) = delete;
+    // Writes what is still pending before returning
+    ~RelayStateWriter();
+
+    // Never waits for the database. Returns false if capacity channels are
+    // already pending, the caller then has to write by itself.
+    bool push(std::string_view channel, bool state, timepoint when);
+    // Same for a transition, capacity transitions can be pending
+    bool push_transition(std::string_view channel, bool state, timepoint when);
+    // Waits until every state pushed so far is written, or given up on
+    // after MAX_ATTEMPTS or on shutdown
+    void flush();
+
+    static void write(const SQLite &sql,
+                      std::string_view channel,
+                      bool state,
+                      timepoint when);
+    static void write_transition(const SQLite &sql,
+                                 std::string_view channel,
+                                 bool state,
+                                 timepoint when);
+
+protected:
+    struct pending_state
+    {
+        bool state;
+        timepoint when;
+    };
+    using batch = std::map<std::string, pending_state, std::less<>>;
+    struct transition
+    {
+        std::string channel;
+        bool state;
+        timepoint when;
+    };
+
+    void run();
+    void write(const batch &states, const std::vector<transition> &transitions);
+
+    SQLite sql_;
+    size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable wake_up_;
+    std::condition_variable written_cv_;
+    batch pending_;
+    std::vector<transition> transitions_;
+    uint64_t pushed_{0};
+    uint64_t written_{0};
+    bool flush_requested_{false};
+    bool stop_{false};
+    std::thread thread_;
+};
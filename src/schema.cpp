@@ -0,0 +1,384 @@
+#include <stdexcept>
+#include <string>
+#include "schema.h"
+#include "log.h"
+
+namespace schema
+{
+    static constexpr migration migrations[] = {
+        {1,
+         "initial schema",
+         "CREATE TABLE IF NOT EXISTS \"events\" ( \n"
+         "    \"SALLE\" TEXT NOT NULL, \n"
+         "    \"ENTETE\" TEXT NOT NULL, \n"
+         "    \"START\" INT NOT NULL, \n"
+         "    \"END\" INT NOT NULL, \n"
+         "    \"ID\" INTEGER NOT NULL, \n"
+         "    PRIMARY KEY(\"ID\" AUTOINCREMENT)); \n"
+         "CREATE TABLE IF NOT EXISTS \"relays\" ( \n"
+         "    \"FULLNAME\" TEXT NOT NULL, \n"
+         "    \"PATTERN_MATCHING\" TEXT NOT NULL, \n"
+         "    \"CHANNEL\" TEXT NOT NULL, \n"
+         "    \"STATE\" INTEGER NOT NULL DEFAULT 0, \n"
+         "    \"LAST_UPDATE\" INTEGER DEFAULT NULL, \n"
+         "    \"INERTIA\" INTEGER NOT NULL DEFAULT 0, \n"
+         "    \"STOP_DURING_MASS\" INTEGER NOT NULL DEFAULT 0);"},
+        {2,
+         "indexes for event lookups by time and room",
+         "CREATE INDEX IF NOT EXISTS events_start ON events (START); \n"
+         "CREATE INDEX IF NOT EXISTS events_end ON events (END); \n"
+         "CREATE INDEX IF NOT EXISTS events_salle ON events (SALLE); \n"
+         "CREATE INDEX IF NOT EXISTS relays_channel ON relays (CHANNEL);"},
+        {3,
+         "explicit key on relays",
+         "CREATE TABLE relays_new ( \n"
+         "    ID INTEGER NOT NULL, \n"
+         "    FULLNAME TEXT NOT NULL, \n"
+         "    PATTERN_MATCHING TEXT NOT NULL, \n"
+         "    CHANNEL TEXT NOT NULL, \n"
+         "    STATE INTEGER NOT NULL DEFAULT 0, \n"
+         "    LAST_UPDATE INTEGER DEFAULT NULL, \n"
+         "    INERTIA INTEGER NOT NULL DEFAULT 0, \n"
+         "    STOP_DURING_MASS INTEGER NOT NULL DEFAULT 0, \n"
+         "    PRIMARY KEY(ID AUTOINCREMENT)); \n"
+         "INSERT INTO relays_new (ID, FULLNAME, PATTERN_MATCHING, CHANNEL, \n"
+         "                        STATE, LAST_UPDATE, INERTIA, STOP_DURING_MASS) \n"
+         "    SELECT rowid, FULLNAME, PATTERN_MATCHING, CHANNEL, \n"
+         "           STATE, LAST_UPDATE, INERTIA, STOP_DURING_MASS \n"
+         "    FROM relays; \n"
+         "DROP TABLE relays; \n"
+         "ALTER TABLE relays_new RENAME TO relays; \n"
+         "CREATE INDEX relays_channel ON relays (CHANNEL);"},
+        {4,
+         "event_relay mapping of rooms to relays",
+         // Resolves events.SALLE LIKE relays.PATTERN_MATCHING once, kept up
+         // to date by triggers on both sides
+         "CREATE TABLE event_relay ( \n"
+         "    EVENT_ID INTEGER NOT NULL, \n"
+         "    RELAY_ID INTEGER NOT NULL, \n"
+         "    PRIMARY KEY (EVENT_ID, RELAY_ID)) WITHOUT ROWID; \n"
+         "CREATE INDEX event_relay_relay ON event_relay (RELAY_ID, EVENT_ID); \n"
+         "INSERT INTO event_relay (EVENT_ID, RELAY_ID) \n"
+         "    SELECT events.ID, relays.ID FROM events \n"
+         "    JOIN relays ON events.SALLE LIKE relays.PATTERN_MATCHING; \n"
+         "CREATE TRIGGER event_relay_event_insert AFTER INSERT ON events \n"
+         "BEGIN \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID) \n"
+         "        SELECT NEW.ID, relays.ID FROM relays \n"
+         "        WHERE NEW.SALLE LIKE relays.PATTERN_MATCHING; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_event_update AFTER UPDATE OF SALLE ON events \n"
+         "BEGIN \n"
+         "    DELETE FROM event_relay WHERE EVENT_ID = OLD.ID; \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID) \n"
+         "        SELECT NEW.ID, relays.ID FROM relays \n"
+         "        WHERE NEW.SALLE LIKE relays.PATTERN_MATCHING; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_event_delete AFTER DELETE ON events \n"
+         "BEGIN \n"
+         "    DELETE FROM event_relay WHERE EVENT_ID = OLD.ID; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_relay_insert AFTER INSERT ON relays \n"
+         "BEGIN \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID) \n"
+         "        SELECT events.ID, NEW.ID FROM events \n"
+         "        WHERE events.SALLE LIKE NEW.PATTERN_MATCHING; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_relay_update AFTER UPDATE OF PATTERN_MATCHING ON relays \n"
+         "BEGIN \n"
+         "    DELETE FROM event_relay WHERE RELAY_ID = OLD.ID; \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID) \n"
+         "        SELECT events.ID, NEW.ID FROM events \n"
+         "        WHERE events.SALLE LIKE NEW.PATTERN_MATCHING; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_relay_delete AFTER DELETE ON relays \n"
+         "BEGIN \n"
+         "    DELETE FROM event_relay WHERE RELAY_ID = OLD.ID; \n"
+         "END;"},
+        {5,
+         "heat windows stored in event_relay",
+         // The heat window of an event on a relay is only computed in
+         // event_heat_window, rows of event_relay are copied from it
+         // whenever one of the columns it depends on changes
+         "DROP TRIGGER event_relay_event_insert; \n"
+         "DROP TRIGGER event_relay_event_update; \n"
+         "DROP TRIGGER event_relay_event_delete; \n"
+         "DROP TRIGGER event_relay_relay_insert; \n"
+         "DROP TRIGGER event_relay_relay_update; \n"
+         "DROP TRIGGER event_relay_relay_delete; \n"
+         "DROP TABLE event_relay; \n"
+         "CREATE VIEW event_heat_window AS \n"
+         "    SELECT events.ID AS EVENT_ID, \n"
+         "           relays.ID AS RELAY_ID, \n"
+         "           events.START - relays.INERTIA AS HEAT_START, \n"
+         "           CASE WHEN relays.STOP_DURING_MASS \n"
+         "                   AND events.ENTETE LIKE '%messe%' \n"
+         "                THEN events.START \n"
+         "                ELSE events.END \n"
+         "                END AS HEAT_END \n"
+         "    FROM events \n"
+         "    JOIN relays ON events.SALLE LIKE relays.PATTERN_MATCHING; \n"
+         "CREATE TABLE event_relay ( \n"
+         "    EVENT_ID INTEGER NOT NULL, \n"
+         "    RELAY_ID INTEGER NOT NULL, \n"
+         "    HEAT_START INT NOT NULL, \n"
+         "    HEAT_END INT NOT NULL, \n"
+         "    PRIMARY KEY (EVENT_ID, RELAY_ID)) WITHOUT ROWID; \n"
+         "CREATE INDEX event_relay_relay ON event_relay (RELAY_ID, EVENT_ID); \n"
+         "CREATE INDEX event_relay_heat ON event_relay (HEAT_START, HEAT_END); \n"
+         // Longest heat window, bounds how far back a window still open
+         // can have started
+         "CREATE INDEX event_relay_heat_length ON event_relay (HEAT_END - HEAT_START); \n"
+         "INSERT INTO event_relay (EVENT_ID, RELAY_ID, HEAT_START, HEAT_END) \n"
+         "    SELECT EVENT_ID, RELAY_ID, HEAT_START, HEAT_END FROM event_heat_window; \n"
+         "CREATE TRIGGER event_relay_event_insert AFTER INSERT ON events \n"
+         "BEGIN \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID, HEAT_START, HEAT_END) \n"
+         "        SELECT EVENT_ID, RELAY_ID, HEAT_START, HEAT_END FROM event_heat_window \n"
+         "        WHERE EVENT_ID = NEW.ID; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_event_update \n"
+         "AFTER UPDATE OF SALLE, ENTETE, START, END ON events \n"
+         "BEGIN \n"
+         "    DELETE FROM event_relay WHERE EVENT_ID = OLD.ID; \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID, HEAT_START, HEAT_END) \n"
+         "        SELECT EVENT_ID, RELAY_ID, HEAT_START, HEAT_END FROM event_heat_window \n"
+         "        WHERE EVENT_ID = NEW.ID; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_event_delete AFTER DELETE ON events \n"
+         "BEGIN \n"
+         "    DELETE FROM event_relay WHERE EVENT_ID = OLD.ID; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_relay_insert AFTER INSERT ON relays \n"
+         "BEGIN \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID, HEAT_START, HEAT_END) \n"
+         "        SELECT EVENT_ID, RELAY_ID, HEAT_START, HEAT_END FROM event_heat_window \n"
+         "        WHERE RELAY_ID = NEW.ID; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_relay_update \n"
+         "AFTER UPDATE OF PATTERN_MATCHING, INERTIA, STOP_DURING_MASS ON relays \n"
+         "BEGIN \n"
+         "    DELETE FROM event_relay WHERE RELAY_ID = OLD.ID; \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID, HEAT_START, HEAT_END) \n"
+         "        SELECT EVENT_ID, RELAY_ID, HEAT_START, HEAT_END FROM event_heat_window \n"
+         "        WHERE RELAY_ID = NEW.ID; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_relay_delete AFTER DELETE ON relays \n"
+         "BEGIN \n"
+         "    DELETE FROM event_relay WHERE RELAY_ID = OLD.ID; \n"
+         "END;"},
+        {6,
+         "content hash of events",
+         // Events with the same content are the same event, only the
+         // oldest copy is kept
+         "ALTER TABLE events ADD COLUMN HASH INTEGER; \n"
+         "UPDATE events SET HASH = content_hash(SALLE, ENTETE, START, END); \n"
+         "DELETE FROM events WHERE ID NOT IN ( \n"
+         "    SELECT MIN(ID) FROM events GROUP BY HASH); \n"
+         "CREATE UNIQUE INDEX events_hash ON events (HASH);"},
+        {7,
+         "calendar uid of events",
+         // Events from the calendar are keyed on their UID, the content
+         // hash only identifies the ones without
+         "ALTER TABLE events ADD COLUMN UID TEXT; \n"
+         "ALTER TABLE events ADD COLUMN SEQUENCE INTEGER NOT NULL DEFAULT 0; \n"
+         "ALTER TABLE events ADD COLUMN LAST_MODIFIED INTEGER NOT NULL DEFAULT 0; \n"
+         "CREATE UNIQUE INDEX events_uid ON events (UID); \n"
+         "DROP INDEX events_hash; \n"
+         "CREATE UNIQUE INDEX events_hash ON events (HASH) WHERE UID IS NULL;"},
+        {8,
+         "relay transition log and on-time rollups",
+         "CREATE TABLE relay_transitions ( \n"
+         "    ID INTEGER PRIMARY KEY, \n"
+         "    CHANNEL TEXT NOT NULL, \n"
+         "    STATE INTEGER NOT NULL, \n"
+         "    TIME INTEGER NOT NULL); \n"
+         "CREATE INDEX relay_transitions_channel ON relay_transitions (CHANNEL, TIME); \n"
+         "CREATE TRIGGER relay_transitions_no_update BEFORE UPDATE ON relay_transitions \n"
+         "BEGIN \n"
+         "    SELECT RAISE(ABORT, 'relay_transitions is append-only'); \n"
+         "END; \n"
+         "CREATE TRIGGER relay_transitions_no_delete BEFORE DELETE ON relay_transitions \n"
+         "BEGIN \n"
+         "    SELECT RAISE(ABORT, 'relay_transitions is append-only'); \n"
+         "END; \n"
+         // Seconds spent on during each hour (UTC) and each local day,
+         // hours and days without any are left out
+         "CREATE TABLE relay_hourly_on_time ( \n"
+         "    CHANNEL TEXT NOT NULL, \n"
+         "    HOUR INTEGER NOT NULL, \n"
+         "    ON_SECONDS INTEGER NOT NULL, \n"
+         "    PRIMARY KEY (CHANNEL, HOUR)) WITHOUT ROWID; \n"
+         "CREATE TABLE relay_daily_on_time ( \n"
+         "    CHANNEL TEXT NOT NULL, \n"
+         "    DAY INTEGER NOT NULL, \n"
+         "    ON_SECONDS INTEGER NOT NULL, \n"
+         "    PRIMARY KEY (CHANNEL, DAY)) WITHOUT ROWID; \n"
+         "CREATE INDEX relay_daily_on_time_day ON relay_daily_on_time (DAY); \n"
+         // Transitions before UNTIL are rolled up, the relay was in STATE
+         // at that time
+         "CREATE TABLE relay_rollup_progress ( \n"
+         "    CHANNEL TEXT NOT NULL PRIMARY KEY, \n"
+         "    UNTIL INTEGER NOT NULL, \n"
+         "    STATE INTEGER NOT NULL) WITHOUT ROWID;"},
+        {9,
+         "full-text index of events",
+         // Words of SALLE and ENTETE, without case nor accents, indexed
+         // from the events table itself. The index is written first in the
+         // triggers of events, event_heat_window matches through it. The
+         // query is given as a table argument, the MATCH operator is
+         // refused in views with trusted_schema off.
+         "CREATE VIRTUAL TABLE events_fts USING fts5( \n"
+         "    SALLE, ENTETE, \n"
+         "    content = 'events', content_rowid = 'ID', \n"
+         "    tokenize = 'unicode61 remove_diacritics 2'); \n"
+         "INSERT INTO events_fts (events_fts) VALUES ('rebuild'); \n"
+         "DROP TRIGGER event_relay_event_insert; \n"
+         "DROP TRIGGER event_relay_event_update; \n"
+         "DROP TRIGGER event_relay_event_delete; \n"
+         "DROP VIEW event_heat_window; \n"
+         "CREATE VIEW event_heat_window AS \n"
+         "    SELECT events.ID AS EVENT_ID, \n"
+         "           relays.ID AS RELAY_ID, \n"
+         "           events.START - relays.INERTIA AS HEAT_START, \n"
+         "           CASE WHEN relays.STOP_DURING_MASS \n"
+         "                   AND EXISTS (SELECT 1 FROM events_fts('ENTETE : messe*') \n"
+         "                               WHERE events_fts.rowid = events.ID) \n"
+         "                THEN events.START \n"
+         "                ELSE events.END \n"
+         "                END AS HEAT_END \n"
+         "    FROM events \n"
+         "    JOIN relays ON events.SALLE LIKE relays.PATTERN_MATCHING; \n"
+         "CREATE TRIGGER event_relay_event_insert AFTER INSERT ON events \n"
+         "BEGIN \n"
+         "    INSERT INTO events_fts (rowid, SALLE, ENTETE) \n"
+         "        VALUES (NEW.ID, NEW.SALLE, NEW.ENTETE); \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID, HEAT_START, HEAT_END) \n"
+         "        SELECT EVENT_ID, RELAY_ID, HEAT_START, HEAT_END FROM event_heat_window \n"
+         "        WHERE EVENT_ID = NEW.ID; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_event_update \n"
+         "AFTER UPDATE OF SALLE, ENTETE, START, END ON events \n"
+         "BEGIN \n"
+         "    INSERT INTO events_fts (events_fts, rowid, SALLE, ENTETE) \n"
+         "        VALUES ('delete', OLD.ID, OLD.SALLE, OLD.ENTETE); \n"
+         "    INSERT INTO events_fts (rowid, SALLE, ENTETE) \n"
+         "        VALUES (NEW.ID, NEW.SALLE, NEW.ENTETE); \n"
+         "    DELETE FROM event_relay WHERE EVENT_ID = OLD.ID; \n"
+         "    INSERT INTO event_relay (EVENT_ID, RELAY_ID, HEAT_START, HEAT_END) \n"
+         "        SELECT EVENT_ID, RELAY_ID, HEAT_START, HEAT_END FROM event_heat_window \n"
+         "        WHERE EVENT_ID = NEW.ID; \n"
+         "END; \n"
+         "CREATE TRIGGER event_relay_event_delete AFTER DELETE ON events \n"
+         "BEGIN \n"
+         "    INSERT INTO events_fts (events_fts, rowid, SALLE, ENTETE) \n"
+         "        VALUES ('delete', OLD.ID, OLD.SALLE, OLD.ENTETE); \n"
+         "    DELETE FROM event_relay WHERE EVENT_ID = OLD.ID; \n"
+         "END; \n"
+         // Mass is now a word of ENTETE, no longer any substring
+         "DELETE FROM event_relay; \n"
+         "INSERT INTO event_relay (EVENT_ID, RELAY_ID, HEAT_START, HEAT_END) \n"
+         "    SELECT EVENT_ID, RELAY_ID, HEAT_START, HEAT_END FROM event_heat_window;"},
+        {10,
+         "change counter of the schedule",
+         // Bumped by every write of the heat windows or of the relays they
+         // are on (event_relay is rewritten when its events change),
+         // writes of relay states leave it as it is
+         "CREATE TABLE schedule_changes ( \n"
+         "    ID INTEGER PRIMARY KEY CHECK (ID = 1), \n"
+         "    COUNT INTEGER NOT NULL); \n"
+         "INSERT INTO schedule_changes (ID, COUNT) VALUES (1, 0); \n"
+         "CREATE TRIGGER schedule_changes_event_relay_insert AFTER INSERT ON event_relay \n"
+         "BEGIN \n"
+         "    UPDATE schedule_changes SET COUNT = COUNT + 1; \n"
+         "END; \n"
+         "CREATE TRIGGER schedule_changes_event_relay_update AFTER UPDATE ON event_relay \n"
+         "BEGIN \n"
+         "    UPDATE schedule_changes SET COUNT = COUNT + 1; \n"
+         "END; \n"
+         "CREATE TRIGGER schedule_changes_event_relay_delete AFTER DELETE ON event_relay \n"
+         "BEGIN \n"
+         "    UPDATE schedule_changes SET COUNT = COUNT + 1; \n"
+         "END; \n"
+         "CREATE TRIGGER schedule_changes_relay_insert AFTER INSERT ON relays \n"
+         "BEGIN \n"
+         "    UPDATE schedule_changes SET COUNT = COUNT + 1; \n"
+         "END; \n"
+         "CREATE TRIGGER schedule_changes_relay_update \n"
+         "AFTER UPDATE OF ID, CHANNEL, FULLNAME ON relays \n"
+         "BEGIN \n"
+         "    UPDATE schedule_changes SET COUNT = COUNT + 1; \n"
+         "END; \n"
+         "CREATE TRIGGER schedule_changes_relay_delete AFTER DELETE ON relays \n"
+         "BEGIN \n"
+         "    UPDATE schedule_changes SET COUNT = COUNT + 1; \n"
+         "END;"},
+    };
+
+    int64_t content_hash(std::string_view room,
+                         std::string_view description,
+                         int64_t start,
+                         int64_t end)
+    {
+        // FNV-1a, the texts are followed by their length so that moving
+        // characters from one to the other changes the hash
+        uint64_t hash = 0xcbf29ce484222325;
+        auto add = [&](uint64_t value)
+        {
+            for (int i = 0; i < 8; i++, value >>= 8)
+                hash = (hash ^ (value & 0xff)) * 0x100000001b3;
+        };
+        auto add_text = [&](std::string_view text)
+        {
+            for (unsigned char c : text)
+                hash = (hash ^ c) * 0x100000001b3;
+            add(text.size());
+        };
+        add_text(room);
+        add_text(description);
+        add(start);
+        add(end);
+        return static_cast<int64_t>(hash);
+    }
+
+    int latest_version()
+    {
+        return std::size(migrations);
+    }
+
+    int version(const SQLite &sql)
+    {
+        return sql.query<int>("PRAGMA user_version").first().value_or(0);
+    }
+
+    void migrate(SQLite &sql)
+    {
+        sql.create_function("content_hash",
+                            4,
+                            [](const SQLite::Arguments &args)
+                            {
+                                return content_hash(args.get<std::string_view>(0),
+                                                    args.get<std::string_view>(1),
+                                                    args.get<int64_t>(2),
+                                                    args.get<int64_t>(3));
+                            });
+
+        auto current = version(sql);
+        if (current > latest_version())
+            throw std::runtime_error(
+                "Database schema version " + std::to_string(current) +
+                " is newer than the supported " + std::to_string(latest_version()));
+
+        for (const auto &m : migrations)
+        {
+            if (m.version <= current)
+                continue;
+            INFO << "Migrating database to version " << m.version
+                 << " (" << m.description << ")" << std::endl;
+            auto transaction = sql.transaction();
+            sql.exec_wo_return(m.sql);
+            sql.exec_wo_return("PRAGMA user_version = " + std::to_string(m.version));
+            transaction.success();
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string_view>
+#include "sqlite.h"
+
+namespace schema
+{
+    // Migration bringing the database from version - 1 to version
+    struct migration
+    {
+        int version;
+        std::string_view description;
+        std::string_view sql;
+    };
+
+    // Identifies an event by its content, also available in SQL as
+    // content_hash(SALLE, ENTETE, START, END)
+    int64_t content_hash(std::string_view room,
+                         std::string_view description,
+                         int64_t start,
+                         int64_t end);
+
+    int latest_version();
+    int version(const SQLite &sql);
+    // Registers the SQL functions used by the schema, then applies every
+    // migration newer than PRAGMA user_version, each one in its own
+    // transaction
+    void migrate(SQLite &sql);
+}
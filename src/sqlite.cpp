@@ -1,42 +1,169 @@
 #include <string>
 #include <string_view>
 #include <stdexcept>
+#include <exception>
 #include "sqlite.h"
 #include <sqlite3.h>
 
-SQLite::SQLite(std::string_view path)
+SQLite::SQLite(std::string_view path) : SQLite(path, Options{})
+{
+}
+
+SQLite::SQLite(std::string_view path, const Options &options)
+    : statement_cache_size_(options.statement_cache_size),
+      profiler_(options.profiler)
 {
     std::string p{path};
-    sqlite3_open(p.c_str(), &db_);
+    int flags = options.read_only
+                    ? SQLITE_OPEN_READONLY
+                    : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    if (sqlite3_open_v2(p.c_str(), &db_, flags | SQLITE_OPEN_URI, nullptr) != SQLITE_OK)
+    {
+        std::string error = db_ ? sqlite3_errmsg(db_) : "out of memory";
+        sqlite3_close(db_);
+        throw std::runtime_error{"Impossible to open " + p + " : " + error};
+    }
+    sqlite3_busy_timeout(db_, static_cast<int>(options.busy_timeout.count()));
+    if (profiler_)
+        sqlite3_trace_v2(db_, SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW, trace, this);
+    if (options.wal && !options.read_only)
+    {
+        try
+        {
+            exec_wo_return("PRAGMA journal_mode=WAL");
+            exec_wo_return("PRAGMA synchronous=NORMAL");
+        }
+        catch (...)
+        {
+            sqlite3_close(db_);
+            throw;
+        }
+    }
+}
+
+int SQLite::trace(unsigned type, void *context, void *p, void *x)
+{
+    auto &self = *static_cast<SQLite *>(context);
+    auto stmt = static_cast<sqlite3_stmt *>(p);
+    if (type == SQLITE_TRACE_ROW)
+    {
+        self.pending_rows_[stmt]++;
+    }
+    else if (type == SQLITE_TRACE_PROFILE)
+    {
+        uint64_t rows = 0;
+        if (auto it = self.pending_rows_.find(stmt); it != self.pending_rows_.end())
+        {
+            rows = it->second;
+            self.pending_rows_.erase(it);
+        }
+        auto req = sqlite3_sql(stmt);
+        self.profiler_->record(req ? req : "",
+                               chrono::nanoseconds{*static_cast<sqlite3_int64 *>(x)},
+                               rows);
+    }
+    return 0;
+}
+
+void SQLite::Profiler::record(std::string_view req, chrono::nanoseconds duration, uint64_t rows)
+{
+    std::lock_guard lock{mutex_};
+    auto it = stats_.find(req);
+    if (it == stats_.end())
+        it = stats_.emplace(req, Stats{}).first;
+    auto &stats = it->second;
+    stats.count++;
+    stats.rows += rows;
+    stats.total += duration;
+    stats.max = std::max(stats.max, duration);
+}
+
+SQLite::Profiler::Report SQLite::Profiler::report() const
+{
+    std::lock_guard lock{mutex_};
+    return stats_;
+}
+
+void SQLite::Profiler::reset()
+{
+    std::lock_guard lock{mutex_};
+    stats_.clear();
 }
 
 SQLite::~SQLite()
 {
+    clear_statement_cache();
     sqlite3_close(db_);
 }
 
-void SQLite::exec_wo_return(std::string_view req) const
+SQLite::Statement::Statement(sqlite3_stmt *stmt, bool *in_use)
+    : stmt_(stmt), in_use_(in_use)
 {
-    std::string r{req};
-    char *err_msg = NULL;
-    int ret = sqlite3_exec(db_, r.c_str(), NULL, NULL, &err_msg);
-    if (ret)
-        throw std::runtime_error(std::string{"SQL error :"} + sqlite3_errmsg(db_));
 }
 
-// helper type for the visitor #4
-template <class... Ts>
-struct overloaded : Ts...
+SQLite::Statement::Statement(Statement &&other)
+    : stmt_(other.stmt_), in_use_(other.in_use_)
 {
-    using Ts::operator()...;
-};
-// explicit deduction guide (not needed as of C++20)
-template <class... Ts>
-overloaded(Ts...) -> overloaded<Ts...>;
+    other.stmt_ = nullptr;
+}
 
-std::vector<SQLite::SqlRow> SQLite::exec(std::string_view req, const SQLite::Params &param) const
+SQLite::Statement::~Statement()
 {
-    std::vector<SqlRow> retval;
+    if (!stmt_)
+        return;
+    if (!in_use_)
+    {
+        sqlite3_finalize(stmt_);
+        return;
+    }
+    sqlite3_reset(stmt_);
+    sqlite3_clear_bindings(stmt_);
+    *in_use_ = false;
+}
+
+void SQLite::set_statement_cache_size(size_t size)
+{
+    statement_cache_size_ = size;
+    evict_statements(size);
+}
+
+void SQLite::clear_statement_cache()
+{
+    evict_statements(0);
+}
+
+void SQLite::evict_statements(size_t size) const
+{
+    // Statements lent stay, the cache is over size until they are back
+    auto it = statement_cache_.end();
+    while (statement_cache_.size() > size && it != statement_cache_.begin())
+    {
+        --it;
+        if (it->in_use)
+            continue;
+        statement_index_.erase(it->req);
+        sqlite3_finalize(it->stmt);
+        it = statement_cache_.erase(it);
+    }
+}
+
+SQLite::Statement SQLite::prepare(std::string_view req) const
+{
+    if (auto it = statement_index_.find(req);
+        it != statement_index_.end())
+    {
+        auto &cached = *it->second;
+        // Already lent (nested query on the same text) : use a fresh one
+        if (!cached.in_use)
+        {
+            statement_cache_.splice(statement_cache_.begin(),
+                                    statement_cache_,
+                                    it->second);
+            cached.in_use = true;
+            return Statement{cached.stmt, &cached.in_use};
+        }
+    }
+
     sqlite3_stmt *stmt; // will point to prepared stamement object
     if (
         sqlite3_prepare_v2(
@@ -52,77 +179,273 @@ std::vector<SQLite::SqlRow> SQLite::exec(std::string_view req, const SQLite::Par
             + " : "
             + sqlite3_errmsg(db_)};
     }
-    int bind_idx = 1;
-    auto expected_count = static_cast<size_t>(sqlite3_bind_parameter_count(stmt));
-    auto actual_count = param.size();
-    if (actual_count != expected_count)
+
+    if (statement_cache_size_ == 0 || statement_index_.count(req))
+        return Statement{stmt, nullptr};
+
+    evict_statements(statement_cache_size_ - 1);
+    statement_cache_.push_front({std::string{req}, stmt, true});
+    statement_index_.emplace(statement_cache_.front().req,
+                             statement_cache_.begin());
+    return Statement{stmt, &statement_cache_.front().in_use};
+}
+
+void SQLite::exec_wo_return(std::string_view req) const
+{
+    std::string r{req};
+    char *err_msg = NULL;
+    int ret = sqlite3_exec(db_, r.c_str(), NULL, NULL, &err_msg);
+    if (ret)
+        throw std::runtime_error(std::string{"SQL error :"} + sqlite3_errmsg(db_));
+}
+
+void sql_parameter_count_mismatch()
+{
+    throw std::logic_error{"SQL parameter count mismatch"};
+}
+
+int64_t SQLite::changes() const
+{
+    return sqlite3_changes64(db_);
+}
+
+bool SQLite::in_transaction() const
+{
+    return !sqlite3_get_autocommit(db_);
+}
+
+void SQLite::backup(const SQLite &from, SQLite &to)
+{
+    auto backup = sqlite3_backup_init(to.db_, "main", from.db_, "main");
+    if (!backup)
+        throw std::runtime_error{
+            std::string{"Error while starting backup : "} + sqlite3_errmsg(to.db_)};
+    // Busy or locked for 5s at most, as long as a busy timeout
+    constexpr int max_attempts = 50;
+    int ret;
+    int attempts = 0;
+    do
+    {
+        ret = sqlite3_backup_step(backup, -1);
+        if (ret == SQLITE_BUSY || ret == SQLITE_LOCKED)
+            sqlite3_sleep(100);
+    } while (ret == SQLITE_OK ||
+             ((ret == SQLITE_BUSY || ret == SQLITE_LOCKED) && ++attempts < max_attempts));
+    sqlite3_backup_finish(backup);
+    if (ret != SQLITE_DONE)
+        throw std::runtime_error{
+            std::string{"Error during backup : "} + sqlite3_errstr(ret)};
+}
+
+void SQLite::create_function(std::string_view name, int arg_count, IntegerFunction function)
+{
+    auto call = [](sqlite3_context *context, int argc, sqlite3_value **argv)
+    {
+        Arguments args{argc, argv};
+        for (int i = 0; i < argc; i++)
+        {
+            if (args.is_null(i))
+            {
+                sqlite3_result_null(context);
+                return;
+            }
+        }
+        try
+        {
+            auto &function = *static_cast<IntegerFunction *>(sqlite3_user_data(context));
+            sqlite3_result_int64(context, function(args));
+        }
+        catch (std::exception &e)
+        {
+            sqlite3_result_error(context, e.what(), -1);
+        }
+    };
+    auto destroy = [](void *p)
+    {
+        delete static_cast<IntegerFunction *>(p);
+    };
+
+    std::string n{name};
+    auto ret = sqlite3_create_function_v2(db_,
+                                          n.c_str(),
+                                          arg_count,
+                                          SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                          new IntegerFunction{std::move(function)},
+                                          call,
+                                          nullptr,
+                                          nullptr,
+                                          destroy);
+    if (ret != SQLITE_OK)
+        throw std::runtime_error{
+            "Impossible to create SQL function " + n + " : " + sqlite3_errmsg(db_)};
+}
+
+std::vector<std::string> SQLite::explain(std::string_view req) const
+{
+    std::string explain_req = "EXPLAIN QUERY PLAN " + std::string{req};
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db_, explain_req.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        throw std::runtime_error{
+            "Error while executing sql : " + explain_req + " : " + sqlite3_errmsg(db_)};
+    std::vector<std::string> retval;
+    Cursor cursor{Statement{stmt, nullptr}};
+    while (cursor.next())
+        retval.emplace_back(cursor.row().get<std::string>(3));
+    return retval;
+}
+
+void SQLite::Statement::check_parameter_count(size_t count) const
+{
+    auto expected_count = static_cast<size_t>(sqlite3_bind_parameter_count(stmt_));
+    if (count != expected_count)
         throw std::runtime_error(
             "In SQL (" +
-            std::string{req} +
+            std::string{sqlite3_sql(stmt_)} +
             "), expected " +
             std::to_string(expected_count) +
             " parameters, got " +
-            std::to_string(actual_count));
-    for (const auto &s : param)
-    {
-        std::visit(overloaded{[&](std::string_view s)
-                              {
-                                  sqlite3_bind_text(
-                                      stmt,
-                                      bind_idx,
-                                      s.data(),
-                                      s.length(),
-                                      SQLITE_STATIC);
-                              },
-                              [&](int64_t i)
-                              {
-                                  sqlite3_bind_int64(
-                                      stmt,
-                                      bind_idx,
-                                      i);
-                              },
-                              [&](timepoint i)
-                              {
-                                  sqlite3_bind_int64(
-                                      stmt,
-                                      bind_idx,
-                                      to_timestamp(i));
-                              },
-                              [&](double i)
-                              {
-                                  sqlite3_bind_double(
-                                      stmt,
-                                      bind_idx,
-                                      i);
-                              }},
-                   s);
-        bind_idx++;
-    }
+            std::to_string(count));
+}
+
+void SQLite::Statement::bind(int idx, int64_t value)
+{
+    sqlite3_bind_int64(stmt_, idx, value);
+}
+
+void SQLite::Statement::bind(int idx, double value)
+{
+    sqlite3_bind_double(stmt_, idx, value);
+}
+
+void SQLite::Statement::bind(int idx, std::string_view value)
+{
+    sqlite3_bind_text(stmt_, idx, value.data(), value.length(), SQLITE_STATIC);
+}
+
+void SQLite::Statement::bind(int idx, timepoint value)
+{
+    sqlite3_bind_int64(stmt_, idx, to_timestamp(value));
+}
+
+void SQLite::Statement::bind(int idx, std::nullptr_t)
+{
+    sqlite3_bind_null(stmt_, idx);
+}
+
+SQLite::Cursor::Cursor(Statement &&statement)
+    : statement_(std::move(statement)), row_(statement_.get())
+{
+}
 
-    bool done = false;
-    while (!done)
+bool SQLite::Cursor::next()
+{
+    if (done_)
+        return false;
+    auto stmt = statement_.get();
+    switch (sqlite3_step(stmt))
     {
-        auto er = sqlite3_step(stmt);
-        switch (er)
-        {
-        case SQLITE_ROW:
-            retval.emplace_back();
-            for (int i = 0; i < sqlite3_column_count(stmt); i++)
-            {
-                auto cell = reinterpret_cast<const char *>(sqlite3_column_text(stmt, i));
-                auto length = sqlite3_column_bytes(stmt, i);
-                retval.back().emplace_back(cell, length);
-            }
-            break;
-        case SQLITE_DONE:
-            done = true;
-            break;
-        default:
-            throw std::runtime_error{"Error while executing sql : " + std::string{req} + " : " + sqlite3_errmsg(db_)};
-        }
+    case SQLITE_ROW:
+        return true;
+    case SQLITE_DONE:
+        done_ = true;
+        return false;
+    default:
+        done_ = true;
+        throw std::runtime_error{
+            "Error while executing sql : "
+            + std::string{sqlite3_sql(stmt)}
+            + " : "
+            + sqlite3_errmsg(sqlite3_db_handle(stmt))};
     }
-    sqlite3_finalize(stmt);
-    return retval;
+}
+
+int SQLite::Row::column_count() const
+{
+    return sqlite3_column_count(stmt_);
+}
+
+bool SQLite::Row::is_null(int col) const
+{
+    return sqlite3_column_type(stmt_, col) == SQLITE_NULL;
+}
+
+template <>
+int64_t SQLite::Row::get<int64_t>(int col) const
+{
+    return sqlite3_column_int64(stmt_, col);
+}
+
+template <>
+int SQLite::Row::get<int>(int col) const
+{
+    return sqlite3_column_int(stmt_, col);
+}
+
+template <>
+bool SQLite::Row::get<bool>(int col) const
+{
+    return sqlite3_column_int(stmt_, col) != 0;
+}
+
+template <>
+double SQLite::Row::get<double>(int col) const
+{
+    return sqlite3_column_double(stmt_, col);
+}
+
+template <>
+std::string_view SQLite::Row::get<std::string_view>(int col) const
+{
+    auto cell = reinterpret_cast<const char *>(sqlite3_column_text(stmt_, col));
+    auto length = sqlite3_column_bytes(stmt_, col);
+    if (!cell)
+        return {};
+    return {cell, static_cast<size_t>(length)};
+}
+
+template <>
+std::string SQLite::Row::get<std::string>(int col) const
+{
+    return std::string{get<std::string_view>(col)};
+}
+
+template <>
+timepoint SQLite::Row::get<timepoint>(int col) const
+{
+    return from_timestamp(get<int64_t>(col));
+}
+
+bool SQLite::Arguments::is_null(int idx) const
+{
+    return sqlite3_value_type(argv_[idx]) == SQLITE_NULL;
+}
+
+template <>
+int64_t SQLite::Arguments::get<int64_t>(int idx) const
+{
+    return sqlite3_value_int64(argv_[idx]);
+}
+
+template <>
+std::string_view SQLite::Arguments::get<std::string_view>(int idx) const
+{
+    auto value = reinterpret_cast<const char *>(sqlite3_value_text(argv_[idx]));
+    auto length = sqlite3_value_bytes(argv_[idx]);
+    if (!value)
+        return {};
+    return {value, static_cast<size_t>(length)};
+}
+
+void SQLite::set_update_hook(UpdateHook hook)
+{
+    update_hook_ = std::move(hook);
+    sqlite3_update_hook(db_, update_hook_ ? update : nullptr, this);
+}
+
+void SQLite::update(void *context, int operation, const char *database, const char *table, long long rowid)
+{
+    auto &self = *static_cast<SQLite *>(context);
+    self.update_hook_(operation, database, table, rowid);
 }
 
 SQLite::Transaction SQLite::transaction()
@@ -130,10 +453,23 @@ SQLite::Transaction SQLite::transaction()
     return Transaction{*this};
 }
 
-SQLite::Transaction::Transaction(SQLite &db) : db_(db), success_(false)
+SQLite::Transaction::Transaction(SQLite &db)
+    : db_(db),
+      depth_(db.transaction_depth_),
+      uncaught_exceptions_(std::uncaught_exceptions())
+{
+    if (depth_ == 0)
+        db_.exec_wo_return("BEGIN IMMEDIATE TRANSACTION");
+    else
+        db_.exec_wo_return("SAVEPOINT " + savepoint());
+    db_.transaction_depth_++;
+}
+
+std::string SQLite::Transaction::savepoint() const
 {
-    db_.exec_wo_return("BEGIN TRANSACTION");
+    return "nested_" + std::to_string(depth_);
 }
+
 void SQLite::Transaction::failure()
 {
     success_ = false;
@@ -143,10 +479,41 @@ void SQLite::Transaction::success()
 {
     success_ = true;
 }
-SQLite::Transaction::~Transaction()
+
+void SQLite::Transaction::rollback() noexcept
 {
-    if (success_)
-        db_.exec_wo_return("COMMIT");
-    else
-        db_.exec_wo_return("ROLLBACK");
-}
\ No newline at end of file
+    try
+    {
+        if (depth_ == 0)
+            db_.exec_wo_return("ROLLBACK");
+        else
+            db_.exec_wo_return("ROLLBACK TO " + savepoint() + "; RELEASE " + savepoint());
+    }
+    catch (std::exception &)
+    {
+        // Nothing more can be done, SQLite rolls back by itself on most errors
+    }
+}
+
+SQLite::Transaction::~Transaction() noexcept(false)
+{
+    db_.transaction_depth_--;
+    if (!success_)
+    {
+        rollback();
+        return;
+    }
+    try
+    {
+        if (depth_ == 0)
+            db_.exec_wo_return("COMMIT");
+        else
+            db_.exec_wo_return("RELEASE " + savepoint());
+    }
+    catch (std::exception &)
+    {
+        rollback();
+        if (std::uncaught_exceptions() == uncaught_exceptions_)
+            throw;
+    }
+}
@@ -1,14 +1,37 @@
 #pragma once
 
 #include <string_view>
+#include <string>
 #include <vector>
-#include <variant>
+#include <algorithm>
+#include <stdexcept>
+#include <list>
+#include <tuple>
+#include <optional>
+#include <iterator>
+#include <concepts>
+#include <type_traits>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <functional>
 #include "utils.h"
 
 struct sqlite3;
+struct sqlite3_stmt;
+struct sqlite3_value;
+
+// Not constexpr on purpose : reaching it while checking a constant SQL
+// string turns the parameter count mismatch into a compilation error
+void sql_parameter_count_mismatch();
+
 class SQLite
 {
 public:
+    // Outermost one is a BEGIN IMMEDIATE transaction, nested ones are
+    // savepoints that can be rolled back on their own. Committed on
+    // destruction only if success() was called.
     class Transaction
     {
         friend SQLite;
@@ -17,25 +40,384 @@ public:
         Transaction(SQLite &);
 
     public:
-        ~Transaction();
+        Transaction(const Transaction &) = delete;
+        ~Transaction() noexcept(false);
         void success();
         void failure();
 
     private:
+        std::string savepoint() const;
+        void rollback() noexcept;
+
         SQLite &db_;
+        int depth_;
+        int uncaught_exceptions_;
         bool success_{false};
     };
 
-    using SqlRow = std::vector<std::string>;
-    using Param = std::variant<std::string_view, int64_t, double, timepoint>;
-    using Params = std::vector<Param>;
+    // Current row of a Cursor, valid until the cursor moves
+    class Row
+    {
+    public:
+        Row(sqlite3_stmt *stmt) : stmt_(stmt) {}
+        int column_count() const;
+        bool is_null(int col) const;
+        template <typename T>
+        T get(int col) const;
+
+    private:
+        sqlite3_stmt *stmt_;
+    };
+
+    // Arguments given by SQLite to a function registered with
+    // create_function()
+    class Arguments
+    {
+    public:
+        Arguments(int argc, sqlite3_value **argv) : argc_(argc), argv_(argv) {}
+        int size() const { return argc_; }
+        bool is_null(int idx) const;
+        template <typename T>
+        T get(int idx) const;
+
+    private:
+        int argc_;
+        sqlite3_value **argv_;
+    };
+    using IntegerFunction = std::function<int64_t(const Arguments &)>;
+    // operation is SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE
+    using UpdateHook = std::function<void(int operation,
+                                          std::string_view database,
+                                          std::string_view table,
+                                          int64_t rowid)>;
+
+    // Statement borrowed from the cache (reset, unbound and given back on
+    // destruction) or owned (finalized on destruction)
+    class Statement
+    {
+    public:
+        // in_use is the flag of the cache entry lent, nullptr when owned
+        Statement(sqlite3_stmt *stmt, bool *in_use);
+        Statement(Statement &&other);
+        Statement(const Statement &) = delete;
+        ~Statement();
+        sqlite3_stmt *get() const { return stmt_; }
+
+        void check_parameter_count(size_t count) const;
+        void bind(int idx, int64_t value);
+        void bind(int idx, double value);
+        void bind(int idx, std::string_view value);
+        void bind(int idx, timepoint value);
+        void bind(int idx, std::nullptr_t);
+
+        template <typename T>
+        void bind(int idx, const T &value)
+        {
+            if constexpr (std::is_same_v<T, bool> || std::is_integral_v<T>)
+                bind(idx, static_cast<int64_t>(value));
+            else if constexpr (std::is_floating_point_v<T>)
+                bind(idx, static_cast<double>(value));
+            else if constexpr (std::is_convertible_v<const T &, std::string_view>)
+                bind(idx, std::string_view{value});
+            else
+                bind(idx, std::chrono::time_point_cast<timepoint::duration>(value));
+        }
+
+        template <typename... Args>
+        void bind_all(const Args &...args)
+        {
+            int idx = 1;
+            (bind(idx++, args), ...);
+        }
+
+    private:
+        sqlite3_stmt *stmt_;
+        bool *in_use_;
+    };
+
+    // Steps through the result of a query without copying it. Text
+    // parameters are bound without copy and must outlive the cursor.
+    class Cursor
+    {
+        friend SQLite;
+
+    protected:
+        Cursor(Statement &&statement);
+
+    public:
+        bool next();
+        const Row &row() const { return row_; }
+
+    private:
+        Statement statement_;
+        Row row_;
+        bool done_{false};
+    };
+
+    // How a row is turned into a T : a single column, or one column per
+    // element of a std::tuple. Specialize it to decode other types.
+    template <typename T>
+    struct RowDecoder
+    {
+        static constexpr int columns = 1;
+        static T decode(const Row &row) { return row.get<T>(0); }
+    };
+
+    template <typename... Ts>
+    struct RowDecoder<std::tuple<Ts...>>
+    {
+        static constexpr int columns = sizeof...(Ts);
+        static std::tuple<Ts...> decode(const Row &row)
+        {
+            return decode(row, std::index_sequence_for<Ts...>{});
+        }
+
+    private:
+        template <size_t... I>
+        static std::tuple<Ts...> decode(const Row &row, std::index_sequence<I...>)
+        {
+            return {row.get<Ts>(I)...};
+        }
+    };
+
+    // Cursor whose rows are decoded as T, usable in a range-based for
+    template <typename T>
+    class Rows : public Cursor
+    {
+        friend SQLite;
+
+        Rows(Statement &&statement) : Cursor(std::move(statement))
+        {
+            if (row().column_count() < RowDecoder<T>::columns)
+                throw std::runtime_error{
+                    "Query returns " + std::to_string(row().column_count()) +
+                    " columns, expected " + std::to_string(RowDecoder<T>::columns)};
+        }
+
+    public:
+        class iterator
+        {
+        public:
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+
+            iterator() = default;
+            iterator(Rows *rows) : rows_(rows) { ++*this; }
+            T operator*() const { return RowDecoder<T>::decode(rows_->row()); }
+            iterator &operator++()
+            {
+                if (!rows_->next())
+                    rows_ = nullptr;
+                return *this;
+            }
+            void operator++(int) { ++*this; }
+            bool operator==(std::default_sentinel_t) const { return !rows_; }
+
+        private:
+            Rows *rows_{nullptr};
+        };
+
+        iterator begin() { return iterator{this}; }
+        std::default_sentinel_t end() const { return {}; }
+
+        std::optional<T> first()
+        {
+            if (!next())
+                return std::nullopt;
+            return RowDecoder<T>::decode(row());
+        }
+    };
+
+    // SQL text used without its '?' parameters being counted at compile time
+    struct RuntimeSql
+    {
+        std::string_view sql;
+    };
+    static RuntimeSql runtime(std::string_view sql) { return {sql}; }
+
+    // SQL text checked at compile time, when it is a constant, against the
+    // number of arguments bound to it
+    template <typename... Args>
+    class Sql
+    {
+    public:
+        template <typename S>
+            requires std::convertible_to<const S &, std::string_view>
+        consteval Sql(const S &sql) : sql_(sql)
+        {
+            if (parameter_count(sql_) != sizeof...(Args))
+                sql_parameter_count_mismatch();
+        }
+        Sql(RuntimeSql sql) : sql_(sql.sql), checked_(false) {}
+
+        std::string_view view() const { return sql_; }
+        bool checked() const { return checked_; }
+
+    private:
+        std::string_view sql_;
+        bool checked_{true};
+    };
+
+    // Same numbering as sqlite3_bind_parameter_count : the largest index,
+    // where ?NNN sets the index and a bare ? takes the next one
+    static constexpr size_t parameter_count(std::string_view sql)
+    {
+        size_t count = 0;
+        char quote = 0;
+        for (size_t i = 0; i < sql.size(); i++)
+        {
+            auto c = sql[i];
+            if (quote)
+            {
+                if (c == quote)
+                    quote = 0;
+            }
+            else if (c == '\'' || c == '"')
+                quote = c;
+            else if (c == '?')
+            {
+                size_t idx = 0;
+                while (i + 1 < sql.size() && sql[i + 1] >= '0' && sql[i + 1] <= '9')
+                    idx = idx * 10 + (sql[++i] - '0');
+                count = idx ? std::max(count, idx) : count + 1;
+            }
+        }
+        return count;
+    }
+
+    // Per statement execution statistics, fed by sqlite3_trace_v2 and
+    // shareable between connections
+    class Profiler
+    {
+    public:
+        struct Stats
+        {
+            uint64_t count{0};
+            uint64_t rows{0};
+            chrono::nanoseconds total{0};
+            chrono::nanoseconds max{0};
+        };
+        using Report = std::map<std::string, Stats, std::less<>>;
+
+        void record(std::string_view req, chrono::nanoseconds duration, uint64_t rows);
+        Report report() const;
+        void reset();
+
+    private:
+        mutable std::mutex mutex_;
+        Report stats_;
+    };
+
+    static constexpr size_t DEFAULT_STATEMENT_CACHE_SIZE = 32;
+
+    struct Options
+    {
+        bool read_only{false};
+        // Write-ahead log : readers see the last commit instead of waiting
+        // for the writer. Only meaningful on a read-write connection.
+        bool wal{false};
+        // How long to retry on a locked database before failing
+        chrono::milliseconds busy_timeout{0};
+        size_t statement_cache_size{DEFAULT_STATEMENT_CACHE_SIZE};
+        std::shared_ptr<Profiler> profiler{};
+    };
+
     SQLite(std::string_view path);
+    SQLite(std::string_view path, const Options &options);
+    SQLite(const SQLite &) = delete;
+    SQLite &operator=(const SQLite &) = delete;
     ~SQLite();
     Transaction transaction();
     void exec_wo_return(std::string_view req) const;
-    std::vector<SqlRow> exec(std::string_view req,
-                             const Params &param = {}) const;
+
+    // Runs a statement to completion, returns the number of modified rows
+    template <typename... Args>
+    int64_t exec(Sql<std::type_identity_t<Args>...> req, const Args &...args) const
+    {
+        auto statement = prepare(req, args...);
+        Cursor cursor{std::move(statement)};
+        while (cursor.next())
+            ;
+        return changes();
+    }
+
+    template <typename T, typename... Args>
+    Rows<T> query(Sql<std::type_identity_t<Args>...> req, const Args &...args) const
+    {
+        return Rows<T>{prepare(req, args...)};
+    }
+
+    int64_t changes() const;
+    // True between BEGIN and COMMIT, savepoints included
+    bool in_transaction() const;
+    // Makes function callable from SQL on this connection as name(...)
+    // with arg_count arguments. It must be deterministic, and returns NULL
+    // when one of its arguments is NULL without being called.
+    void create_function(std::string_view name, int arg_count, IntegerFunction function);
+    // Called for each row written through this connection in a rowid
+    // table, triggers included, as it is written : the transaction may
+    // still be rolled back. It must not use the connection.
+    void set_update_hook(UpdateHook hook);
+    // Copies the whole main database of from into to
+    static void backup(const SQLite &from, SQLite &to);
+    // Details of EXPLAIN QUERY PLAN for req, parameters left unbound
+    std::vector<std::string> explain(std::string_view req) const;
+
+    // Prepared statements are kept by SQL text, least recently used ones
+    // are finalized once more than `size` are cached. 0 disables the cache.
+    void set_statement_cache_size(size_t size);
+    void clear_statement_cache();
 
 protected:
+    template <typename... Args>
+    Statement prepare(Sql<Args...> req, const Args &...args) const
+    {
+        auto statement = prepare(req.view());
+        if (!req.checked())
+            statement.check_parameter_count(sizeof...(Args));
+        statement.bind_all(args...);
+        return statement;
+    }
+
+    Statement prepare(std::string_view req) const;
+    void evict_statements(size_t size) const;
+    static int trace(unsigned type, void *context, void *p, void *x);
+    static void update(void *context, int operation, const char *database, const char *table, long long rowid);
+
     sqlite3 *db_;
-};
\ No newline at end of file
+    size_t statement_cache_size_;
+    struct CachedStatement
+    {
+        std::string req;
+        sqlite3_stmt *stmt;
+        // Lent to a Statement : neither evicted nor lent again
+        bool in_use{false};
+    };
+    using StatementCache = std::list<CachedStatement>;
+    mutable StatementCache statement_cache_;
+    mutable std::unordered_map<std::string_view, StatementCache::iterator> statement_index_;
+    std::shared_ptr<Profiler> profiler_;
+    UpdateHook update_hook_;
+    int transaction_depth_{0};
+    // Rows stepped so far by statements not finished yet
+    std::unordered_map<sqlite3_stmt *, uint64_t> pending_rows_;
+};
+
+template <>
+int64_t SQLite::Row::get<int64_t>(int col) const;
+template <>
+int SQLite::Row::get<int>(int col) const;
+template <>
+bool SQLite::Row::get<bool>(int col) const;
+template <>
+double SQLite::Row::get<double>(int col) const;
+template <>
+std::string_view SQLite::Row::get<std::string_view>(int col) const;
+template <>
+std::string SQLite::Row::get<std::string>(int col) const;
+template <>
+timepoint SQLite::Row::get<timepoint>(int col) const;
+template <>
+int64_t SQLite::Arguments::get<int64_t>(int idx) const;
+template <>
+std::string_view SQLite::Arguments::get<std::string_view>(int idx) const;
@@ -0,0 +1,55 @@
+#include "task.h"
+#include "log.h"
+
+namespace
+{
+    // Runs at once and frees itself at the end
+    struct detached
+    {
+        struct promise_type
+        {
+            detached get_return_object() const noexcept { return {}; }
+            std::suspend_never initial_suspend() const noexcept { return {}; }
+            std::suspend_never final_suspend() const noexcept { return {}; }
+            void return_void() const noexcept {}
+            void unhandled_exception() const noexcept { std::terminate(); }
+        };
+    };
+
+    detached start(task<void> t, std::function<void(std::exception_ptr)> done)
+    {
+        std::exception_ptr failure;
+        try
+        {
+            co_await t;
+        }
+        catch (...)
+        {
+            failure = std::current_exception();
+        }
+        done(failure);
+    }
+}
+
+void spawn(task<void> t, std::function<void(std::exception_ptr)> done)
+{
+    start(std::move(t), std::move(done));
+}
+
+void spawn(std::string name, task<void> t)
+{
+    spawn(std::move(t),
+          [name = std::move(name)](std::exception_ptr failure)
+          {
+              if (!failure)
+                  return;
+              try
+              {
+                  std::rethrow_exception(failure);
+              }
+              catch (std::exception &e)
+              {
+                  ERROR << name << " failed : " << e.what() << std::endl;
+              }
+          });
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <utility>
+
+template <typename T = void>
+class task;
+
+namespace detail
+{
+    struct promise_base
+    {
+        struct final_awaiter
+        {
+            bool await_ready() const noexcept { return false; }
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> coroutine) noexcept
+            {
+                return coroutine.promise().continuation_;
+            }
+            void await_resume() const noexcept {}
+        };
+
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        final_awaiter final_suspend() const noexcept { return {}; }
+        void unhandled_exception() { failure_ = std::current_exception(); }
+        void rethrow_if_failed() const
+        {
+            if (failure_)
+                std::rethrow_exception(failure_);
+        }
+
+        // Resumed when the task is over, nothing for a task not awaited
+        std::coroutine_handle<> continuation_{std::noop_coroutine()};
+        std::exception_ptr failure_;
+    };
+
+    template <typename T>
+    struct promise : promise_base
+    {
+        task<T> get_return_object();
+        template <typename U>
+        void return_value(U &&value) { value_.emplace(std::forward<U>(value)); }
+        T result()
+        {
+            rethrow_if_failed();
+            return std::move(*value_);
+        }
+
+        std::optional<T> value_;
+    };
+
+    template <>
+    struct promise<void> : promise_base
+    {
+        task<void> get_return_object();
+        void return_void() const noexcept {}
+        void result() const { rethrow_if_failed(); }
+    };
+}
+
+// Coroutine started when it is awaited, the awaiting one being resumed when
+// it is over with its value or its exception. Tasks are run by the thread
+// resuming them, the reactor's one for those waiting for it.
+template <typename T>
+class [[nodiscard]] task
+{
+public:
+    using promise_type = detail::promise<T>;
+
+    task(task &&other) noexcept : coroutine_(std::exchange(other.coroutine_, nullptr)) {}
+    task &operator=(task &&other) noexcept
+    {
+        std::swap(coroutine_, other.coroutine_);
+        return *this;
+    }
+    ~task()
+    {
+        if (coroutine_)
+            coroutine_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        coroutine_.promise().continuation_ = awaiting;
+        return coroutine_;
+    }
+    T await_resume() { return coroutine_.promise().result(); }
+
+protected:
+    friend promise_type;
+    explicit task(std::coroutine_handle<promise_type> coroutine) : coroutine_(coroutine) {}
+
+    std::coroutine_handle<promise_type> coroutine_;
+};
+
+template <typename T>
+task<T> detail::promise<T>::get_return_object()
+{
+    return task<T>{std::coroutine_handle<promise>::from_promise(*this)};
+}
+
+inline task<void> detail::promise<void>::get_return_object()
+{
+    return task<void>{std::coroutine_handle<promise>::from_promise(*this)};
+}
+
+// Starts t without waiting for it, done is called when it is over with
+// the exception it threw, if any. t keeps running as long as what it
+// awaits resumes it.
+void spawn(task<void> t, std::function<void(std::exception_ptr)> done);
+// Failures are logged as "<name> failed : ..."
+void spawn(std::string name, task<void> t);
@@ -0,0 +1,55 @@
+#include <algorithm>
+#include "taskqueue.h"
+#include "log.h"
+
+void TaskQueue::run(std::string_view key, std::string_view name, job j)
+{
+    auto &queue = queues_[std::string{key}];
+    auto it = std::find_if(queue.begin(),
+                           queue.end(),
+                           [&](const named_job &waiting)
+                           {
+                               return waiting.name == name;
+                           });
+    if (it != queue.end())
+        it->j = std::move(j);
+    else
+        queue.push_back({std::string{name}, std::move(j)});
+    if (!busy_.contains(key))
+        start(std::string{key});
+}
+
+void TaskQueue::start(const std::string &key)
+{
+    auto ready = queues_.find(key);
+    if (ready == queues_.end())
+        return;
+    auto next = std::move(ready->second.front());
+    ready->second.pop_front();
+    if (ready->second.empty())
+        queues_.erase(ready);
+    busy_.insert(key);
+
+    // The job is kept in the frame, the task may use what it captured
+    auto keep_job = [](job j, Reactor &reactor) -> task<void>
+    {
+        co_await j(reactor);
+    };
+    spawn(keep_job(std::move(next.j), reactor_),
+          [this, key, name = std::move(next.name)](std::exception_ptr failure)
+          {
+              if (failure)
+              {
+                  try
+                  {
+                      std::rethrow_exception(failure);
+                  }
+                  catch (std::exception &e)
+                  {
+                      ERROR << name << " for " << key << " failed : " << e.what() << std::endl;
+                  }
+              }
+              busy_.erase(key);
+              start(key);
+          });
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <map>
+#include <list>
+#include <set>
+#include "reactor.h"
+#include "task.h"
+
+// Tasks waiting for remote services, run by the reactor's thread alongside
+// each other. Tasks given the same key run one after the other, never at
+// the same time, and a task waiting under a key is replaced by a newer one
+// of the same name instead of piling up behind a stuck one.
+class TaskQueue
+{
+public:
+    using job = std::function<task<void>(Reactor &)>;
+
+    TaskQueue(Reactor &reactor) : reactor_(reactor) {}
+    TaskQueue(const TaskQueue &) = delete;
+
+    void run(std::string_view key, std::string_view name, job j);
+
+protected:
+    struct named_job
+    {
+        std::string name;
+        job j;
+    };
+
+    void start(const std::string &key);
+
+    Reactor &reactor_;
+    std::map<std::string, std::list<named_job>, std::less<>> queues_;
+    // Keys with a task running
+    std::set<std::string, std::less<>> busy_;
+};
@@ -3,82 +3,10 @@
 #include <stdexcept>
 #include <sstream>
 #include <chrono>
-#include <curl/curl.h>
 #include <string>
 
-using json = nlohmann::json;
 using namespace std::chrono_literals;
 
-static size_t writeMemoryCallback(void *contents, size_t size, size_t nmemb,
-                                  void *userp)
-{
-    size_t realsize = size * nmemb;
-    auto &mem = *static_cast<std::string *>(userp);
-    mem.append(static_cast<char *>(contents), realsize);
-    return realsize;
-}
-
-std::string download(std::string_view url,
-                     const std::map<std::string_view, std::string_view> &headers,
-                     const json &payload)
-{
-    CURL *curl_handle;
-    CURLcode res;
-
-    std::string result;
-    std::string payload_str;
-
-    struct curl_slist *curl_headers = NULL;
-
-    curl_global_init(CURL_GLOBAL_ALL);
-
-    curl_handle = curl_easy_init();
-    curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 0L);
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url.data());
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, writeMemoryCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &result);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-    // added options that may be required
-    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);  // redirects
-    curl_easy_setopt(curl_handle, CURLOPT_HTTPPROXYTUNNEL, 1L); // corp. proxies etc.
-    // curl_easy_setopt(curl_handle, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
-
-    if (!headers.empty())
-    {
-        for (const auto &[key, value] : headers)
-        {
-            std::ostringstream sstr;
-            sstr << key << ": " << value;
-            curl_headers = curl_slist_append(curl_headers, sstr.str().c_str());
-        }
-    }
-    if (!payload.empty())
-    {
-        curl_headers = curl_slist_append(curl_headers, "Content-Type: application/json");
-        std::ostringstream sstr;
-        sstr << payload;
-        payload_str = sstr.str();
-        curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, payload_str.c_str());
-    }
-    if (curl_headers)
-        curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, curl_headers);
-
-    res = curl_easy_perform(curl_handle);
-
-    if (res != CURLE_OK)
-        throw std::runtime_error(
-            "Impossible to retrieve " +
-            std::string{url} +
-            " : " +
-            curl_easy_strerror(res));
-
-    curl_slist_free_all(curl_headers);
-    curl_easy_cleanup(curl_handle);
-    curl_global_cleanup();
-    return result;
-}
-
 timepoint get_time_now()
 {
     return chrono::floor<chrono::seconds>(chrono::system_clock::now());
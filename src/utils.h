@@ -7,10 +7,6 @@
 namespace chrono = std::chrono;
 using timepoint = std::chrono::time_point<std::chrono::system_clock, std::chrono::seconds>;
 
-std::string download(std::string_view url,
-                     const std::map<std::string_view, std::string_view> &headers = {},
-                     const nlohmann::json &payload = {});
-
 int64_t to_timestamp(auto tp)
 {
     return std::chrono::duration_cast<std::chrono::seconds>(